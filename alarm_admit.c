@@ -0,0 +1,288 @@
+/*
+ * alarm_admit.c
+ *
+ * A total is taken by adding first and checking after, undoing the
+ * addition if it went over, so concurrent producers can never take
+ * more than the limit between them; near the limit one may be
+ * refused for room another was about to give back. An undo by a
+ * first attempt wakes the waiters as a give does, in case one went
+ * to sleep on that room.
+ *
+ * No wake-up is lost: a waiting producer counts itself in "waiters"
+ * before it looks for room a last time, and a give returns its
+ * share before it reads "waiters", so either the producer sees the
+ * room or the give sees the producer and broadcasts -- which, under
+ * the mutex, cannot happen before the producer is waiting.
+ */
+#include "errors.h"
+#include "alarm_admit.h"
+#include "alarm_message.h"
+
+#define ADMIT_BUCKETS   1024            /* group count chains */
+
+void alarm_admit_init (alarm_admit_t *admit)
+{
+    pthread_condattr_t cond_attr;
+    int status;
+
+    memset (admit, 0, sizeof (*admit));
+    status = pthread_mutex_init (&admit -> mutex, NULL);
+    if (status != 0) {
+        err_abort (status, "Init mutex");
+    }
+    status = pthread_condattr_init (&cond_attr);
+    if (status != 0) {
+        err_abort (status, "Init cond attr");
+    }
+    status = pthread_condattr_setclock (&cond_attr, CLOCK_MONOTONIC);
+    if (status != 0) {
+        err_abort (status, "Set cond clock");
+    }
+    status = pthread_cond_init (&admit -> cond, &cond_attr);
+    if (status != 0) {
+        err_abort (status, "Init cond");
+    }
+    pthread_condattr_destroy (&cond_attr);
+    status = pthread_mutex_init (&admit -> group_mutex, NULL);
+    if (status != 0) {
+        err_abort (status, "Init mutex");
+    }
+}
+
+void alarm_admit_destroy (alarm_admit_t *admit)
+{
+    alarm_admit_group_t *group, *next;
+    int bucket;
+
+    if (admit -> groups != NULL) {
+        for (bucket = 0; bucket < ADMIT_BUCKETS; bucket++) {
+            for (group = admit -> groups[bucket]; group != NULL; group = next) {
+                next = group -> link;
+                free (group);
+            }
+        }
+        free (admit -> groups);
+    }
+    pthread_mutex_destroy (&admit -> mutex);
+    pthread_cond_destroy (&admit -> cond);
+    pthread_mutex_destroy (&admit -> group_mutex);
+}
+
+/*
+ * The memory an alarm is charged for.
+ */
+static unsigned long admit_bytes (alarm_message_t message)
+{
+    return sizeof (alarm_t) + alarm_message_size (message);
+}
+
+static void admit_peak (atomic_long *peak, long value)
+{
+    long seen = atomic_load (peak);
+
+    while (value > seen && !atomic_compare_exchange_weak (peak, &seen, value)) {
+    }
+}
+
+static void admit_peak_bytes (atomic_ulong *peak, unsigned long value)
+{
+    unsigned long seen = atomic_load (peak);
+
+    while (value > seen && !atomic_compare_exchange_weak (peak, &seen, value)) {
+    }
+}
+
+/*
+ * Wake every producer waiting for room, if there are any.
+ */
+static void admit_wake (alarm_admit_t *admit)
+{
+    int status;
+
+    if (atomic_load (&admit -> waiters) == 0) {
+        return;
+    }
+    status = pthread_mutex_lock (&admit -> mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    status = pthread_cond_broadcast (&admit -> cond);
+    if (status != 0) {
+        err_abort (status, "Broadcast cond");
+    }
+    status = pthread_mutex_unlock (&admit -> mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+/*
+ * Add "count" to a group's count, creating it the first time, and
+ * return the new count -- unless that would go over "limit" (0 for
+ * none), when nothing is added and -1 is returned.
+ */
+static int admit_group_add (alarm_admit_t *admit, int group_id, int count, int limit)
+{
+    alarm_admit_group_t **chain, *group;
+    int status, result;
+
+    status = pthread_mutex_lock (&admit -> group_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    if (admit -> groups == NULL) {
+        admit -> groups = (alarm_admit_group_t**)calloc (ADMIT_BUCKETS, sizeof (alarm_admit_group_t*));
+        if (admit -> groups == NULL) {
+            errno_abort ("Allocate group counts");
+        }
+    }
+    chain = &admit -> groups[((unsigned int) group_id * 2654435769u >> 8) % ADMIT_BUCKETS];
+    for (group = *chain; group != NULL && group -> group_id != group_id; group = group -> link) {
+    }
+    if (group == NULL) {
+        group = (alarm_admit_group_t*)calloc (1, sizeof (alarm_admit_group_t));
+        if (group == NULL) {
+            errno_abort ("Allocate group count");
+        }
+        group -> group_id = group_id;
+        group -> link = *chain;
+        *chain = group;
+    }
+    if (limit > 0 && group -> count + count > limit) {
+        result = -1;
+    } else {
+        group -> count += count;
+        result = group -> count;
+    }
+    status = pthread_mutex_unlock (&admit -> group_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    return result;
+}
+
+/*
+ * Take an alarm's share if there is room for it (or regardless, if
+ * "force"). Returns 0 or the ALARM_LIMIT_ that refused it. A
+ * waiting producer, which has the mutex ("locked"), needn't wake the
+ * others when it undoes: none of them can have looked meanwhile.
+ */
+static int admit_try (alarm_admit_t *admit, alarm_t *alarm, unsigned long bytes, int force,
+    int locked)
+{
+    long alarms = atomic_fetch_add (&admit -> alarms, 1) + 1;
+    unsigned long total;
+    int result = 0;
+
+    if (!force && admit -> max_alarms > 0 && alarms > admit -> max_alarms) {
+        result = ALARM_LIMIT_ALARMS;
+    } else {
+        total = atomic_fetch_add (&admit -> bytes, bytes) + bytes;
+        if (!force && admit -> max_bytes > 0 && total > admit -> max_bytes) {
+            result = ALARM_LIMIT_BYTES;
+        } else if (admit -> max_group > 0
+            && admit_group_add (admit, alarm -> group_id, 1, force ? 0 : admit -> max_group) < 0) {
+            result = ALARM_LIMIT_GROUP;
+        }
+        if (result != 0) {
+            atomic_fetch_sub (&admit -> bytes, bytes);
+        } else {
+            admit_peak_bytes (&admit -> peak_bytes, total);
+        }
+    }
+    if (result != 0) {
+        atomic_fetch_sub (&admit -> alarms, 1);
+        if (!locked) {
+            admit_wake (admit);
+        }
+    } else {
+        admit_peak (&admit -> peak_alarms, alarms);
+    }
+    return result;
+}
+
+int alarm_admit_take (alarm_admit_t *admit, alarm_t *alarm, int how)
+{
+    unsigned long bytes = admit_bytes (alarm -> message);
+    struct timespec cond_time;
+    int result, status;
+
+    // No amount of waiting makes room for this one
+    if (how != ALARM_ADMIT_FORCE && admit -> max_bytes > 0 && bytes > admit -> max_bytes) {
+        return ALARM_LIMIT_BYTES;
+    }
+    result = admit_try (admit, alarm, bytes, how == ALARM_ADMIT_FORCE, 0);
+    if (result == 0) {
+        return 0;
+    }
+    if (how == ALARM_ADMIT_TRY) {
+        return result;
+    }
+
+    /*
+     * LOCKING PROTOCOL:
+     *
+     * The mutex only keeps a give from broadcasting between our
+     * last look for room and the wait. admit_try takes group_mutex
+     * under it, never the other way round.
+     */
+    atomic_fetch_add (&admit -> waits, 1);
+    alarm_timespec (alarm_now () + ALARM_ADMIT_PATIENCE, &cond_time);
+    status = pthread_mutex_lock (&admit -> mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    atomic_fetch_add (&admit -> waiters, 1);
+
+    // Out of patience, look a last time and give up
+    status = 0;
+    while ((result = admit_try (admit, alarm, bytes, 0, 1)) != 0 && status != ETIMEDOUT) {
+        status = pthread_cond_timedwait (&admit -> cond, &admit -> mutex, &cond_time);
+        if (status != 0 && status != ETIMEDOUT) {
+            err_abort (status, "Cond timedwait");
+        }
+    }
+    atomic_fetch_sub (&admit -> waiters, 1);
+    status = pthread_mutex_unlock (&admit -> mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    return result;
+}
+
+void alarm_admit_give (alarm_admit_t *admit, alarm_t *alarm)
+{
+    atomic_fetch_sub (&admit -> alarms, 1);
+    atomic_fetch_sub (&admit -> bytes, admit_bytes (alarm -> message));
+    if (admit -> max_group > 0) {
+        admit_group_add (admit, alarm -> group_id, -1, 0);
+    }
+    admit_wake (admit);
+}
+
+void alarm_admit_change (alarm_admit_t *admit, alarm_t *alarm, alarm_t *request)
+{
+    unsigned long old_bytes = admit_bytes (alarm -> message);
+    unsigned long new_bytes = admit_bytes (request -> message);
+
+    if (new_bytes > old_bytes) {
+        admit_peak_bytes (&admit -> peak_bytes,
+            atomic_fetch_add (&admit -> bytes, new_bytes - old_bytes) + new_bytes - old_bytes);
+    } else {
+        atomic_fetch_sub (&admit -> bytes, old_bytes - new_bytes);
+    }
+    if (admit -> max_group > 0 && alarm -> group_id != request -> group_id) {
+        admit_group_add (admit, request -> group_id, 1, 0);
+        admit_group_add (admit, alarm -> group_id, -1, 0);
+    }
+    admit_wake (admit);
+}
+
+void alarm_admit_usage (alarm_admit_t *admit, alarm_usage_t *usage)
+{
+    usage -> alarms = atomic_load (&admit -> alarms);
+    usage -> peak_alarms = atomic_load (&admit -> peak_alarms);
+    usage -> bytes = atomic_load (&admit -> bytes);
+    usage -> peak_bytes = atomic_load (&admit -> peak_bytes);
+    usage -> waits = atomic_load (&admit -> waits);
+}
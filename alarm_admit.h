@@ -0,0 +1,110 @@
+/*
+ * alarm_admit.h
+ *
+ * Admission control for a scheduler: limits on how many alarms may
+ * be pending at once, in all and in any one group, and on the
+ * memory they take up, counted as each alarm's alarm_t plus its
+ * message's block in the arena. A new alarm is admitted, taking
+ * its share of each limit, before it is submitted, and gives the
+ * share back when it expires or is removed; a producer that finds
+ * no room is refused or waits for some, as it chooses.
+ *
+ * The totals are atomic counters, so admitting an alarm costs a
+ * few atomic additions when there are no limits; the per-group
+ * counts are kept, under a mutex of their own, only when there is
+ * a per-group limit. Peaks are kept so capacity can be planned.
+ */
+#ifndef __alarm_admit_h
+#define __alarm_admit_h
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "alarm_queue.h"
+
+/*
+ * How alarm_admit treats a producer that finds no room.
+ */
+#define ALARM_ADMIT_TRY         0       /* refuse the alarm */
+#define ALARM_ADMIT_WAIT        1       /* wait a while for room */
+#define ALARM_ADMIT_FORCE       2       /* admit it anyway (restoring) */
+
+/*
+ * Longest a producer waits for room before the alarm is refused
+ * after all: room may never come -- periodic alarms never expire --
+ * and a producer that waited for ever couldn't take the cancel that
+ * would make some.
+ */
+#define ALARM_ADMIT_PATIENCE    (5 * ALARM_NSEC_PER_SEC)
+
+/*
+ * Which limit refused an alarm, as alarm_admit returns it.
+ */
+#define ALARM_LIMIT_ALARMS      1
+#define ALARM_LIMIT_GROUP       2
+#define ALARM_LIMIT_BYTES       3
+#define ALARM_LIMIT_MESSAGES    4       /* arena full; found by the caller */
+
+/*
+ * What the admitted alarms take up now and at most so far.
+ */
+typedef struct alarm_usage_tag {
+    long                alarms;
+    long                peak_alarms;
+    unsigned long       bytes;
+    unsigned long       peak_bytes;
+    unsigned long       waits;          /* producers made to wait */
+} alarm_usage_t;
+
+typedef struct alarm_admit_group_tag {
+    struct alarm_admit_group_tag *link;
+    int                 group_id;
+    int                 count;
+} alarm_admit_group_t;
+
+/*
+ * Limits of 0 are no limit. "mutex" and "cond" (on CLOCK_MONOTONIC)
+ * are for producers waiting for room; "group_mutex" protects
+ * "groups".
+ */
+typedef struct alarm_admit_tag {
+    long                max_alarms;
+    int                 max_group;
+    unsigned long       max_bytes;
+    atomic_long         alarms;
+    atomic_long         peak_alarms;
+    atomic_ulong        bytes;
+    atomic_ulong        peak_bytes;
+    atomic_ulong        waits;
+    atomic_int          waiters;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;
+    pthread_mutex_t     group_mutex;
+    alarm_admit_group_t **groups;       /* ADMIT_BUCKETS chains */
+} alarm_admit_t;
+
+extern void alarm_admit_init (alarm_admit_t *admit);
+extern void alarm_admit_destroy (alarm_admit_t *admit);
+
+/*
+ * Take an alarm's share of the limits. Returns 0, or the ALARM_LIMIT_
+ * that refused it: at once with ALARM_ADMIT_TRY, after waiting
+ * ALARM_ADMIT_PATIENCE with ALARM_ADMIT_WAIT. An alarm too big to
+ * fit even with nothing else pending is refused without waiting.
+ */
+extern int alarm_admit_take (alarm_admit_t *admit, alarm_t *alarm, int how);
+
+/*
+ * Give back the share of an alarm that is going away, and wake any
+ * producers waiting for room.
+ */
+extern void alarm_admit_give (alarm_admit_t *admit, alarm_t *alarm);
+
+/*
+ * Move a pending alarm's share to the group and message a change
+ * request is about to give it. A change is never refused.
+ */
+extern void alarm_admit_change (alarm_admit_t *admit, alarm_t *alarm, alarm_t *request);
+
+extern void alarm_admit_usage (alarm_admit_t *admit, alarm_usage_t *usage);
+
+#endif
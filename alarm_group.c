@@ -0,0 +1,171 @@
+/*
+ * alarm_group.c
+ *
+ * Chained hash table keyed by group_id, doubling when the load
+ * factor reaches one, as alarm_index.c does for alarm_id. Each
+ * entry owns its group's member heap; the sifts are the heap
+ * backend's, on alarm_t.group_index instead of queue_index.
+ */
+#include "errors.h"
+#include "alarm_group.h"
+
+#ifndef NO_ALARM_GROUPS
+
+static unsigned int group_hash (alarm_groups_t *groups, int group_id)
+{
+    return ((unsigned int) group_id * 2654435769u) & (groups -> size - 1);
+}
+
+static void group_grow (alarm_groups_t *groups)
+{
+    alarm_members_t **old = groups -> buckets, *members, *next;
+    unsigned int old_size = groups -> size, bucket;
+
+    groups -> size = old_size ? old_size * 2 : 64;
+    groups -> buckets = calloc (groups -> size, sizeof (alarm_members_t*));
+    if (groups -> buckets == NULL) {
+        errno_abort ("Grow group index");
+    }
+    for (bucket = 0; bucket < old_size; bucket++) {
+        for (members = old[bucket]; members != NULL; members = next) {
+            unsigned int hash = group_hash (groups, members -> group_id);
+
+            next = members -> hash_link;
+            members -> hash_link = groups -> buckets[hash];
+            groups -> buckets[hash] = members;
+        }
+    }
+    free (old);
+}
+
+static void group_set (alarm_members_t *members, int index, alarm_heap_entry_t entry)
+{
+    members -> heap[index] = entry;
+    entry.alarm -> group_index = index;
+}
+
+static void group_sift_up (alarm_members_t *members, int index)
+{
+    alarm_heap_entry_t entry = members -> heap[index];
+
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+
+        if (members -> heap[parent].time <= entry.time) {
+            break;
+        }
+        group_set (members, index, members -> heap[parent]);
+        index = parent;
+    }
+    group_set (members, index, entry);
+}
+
+static void group_sift_down (alarm_members_t *members, int index)
+{
+    alarm_heap_entry_t entry = members -> heap[index];
+
+    while (1) {
+        int child = 2 * index + 1;
+
+        if (child >= members -> count) {
+            break;
+        }
+        if (child + 1 < members -> count
+            && members -> heap[child + 1].time < members -> heap[child].time) {
+            child++;
+        }
+        if (entry.time <= members -> heap[child].time) {
+            break;
+        }
+        group_set (members, index, members -> heap[child]);
+        index = child;
+    }
+    group_set (members, index, entry);
+}
+
+void alarm_group_insert (alarm_groups_t *groups, alarm_t *alarm)
+{
+    alarm_members_t *members = alarm_group_find (groups, alarm -> group_id);
+    alarm_heap_entry_t entry;
+    unsigned int hash;
+
+    if (members == NULL) {
+        if (groups -> count >= groups -> size) {
+            group_grow (groups);
+        }
+        members = (alarm_members_t*)calloc (1, sizeof (alarm_members_t));
+        if (members == NULL) {
+            errno_abort ("Allocate group");
+        }
+        members -> group_id = alarm -> group_id;
+        hash = group_hash (groups, alarm -> group_id);
+        members -> hash_link = groups -> buckets[hash];
+        groups -> buckets[hash] = members;
+        groups -> count++;
+    }
+    if (members -> count == members -> capacity) {
+        members -> capacity = members -> capacity ? members -> capacity * 2 : 4;
+        members -> heap = realloc (members -> heap,
+            members -> capacity * sizeof (alarm_heap_entry_t));
+        if (members -> heap == NULL) {
+            errno_abort ("Grow group");
+        }
+    }
+    entry.time = alarm -> time;
+    entry.alarm = alarm;
+    group_set (members, members -> count++, entry);
+    group_sift_up (members, alarm -> group_index);
+}
+
+void alarm_group_remove (alarm_groups_t *groups, alarm_t *alarm)
+{
+    alarm_members_t **last = &groups -> buckets[group_hash (groups, alarm -> group_id)];
+    alarm_members_t *members;
+    int index = alarm -> group_index;
+
+    while ((*last) -> group_id != alarm -> group_id) {
+        last = &(*last) -> hash_link;
+    }
+    members = *last;
+
+    if (--members -> count == 0) {
+        *last = members -> hash_link;
+        groups -> count--;
+        free (members -> heap);
+        free (members);
+    } else if (index != members -> count) {
+        alarm_t *moved = members -> heap[members -> count].alarm;
+
+        group_set (members, index, members -> heap[members -> count]);
+        group_sift_up (members, index);
+        group_sift_down (members, moved -> group_index);
+    }
+    alarm -> group_index = -1;
+}
+
+void alarm_group_update (alarm_groups_t *groups, alarm_t *alarm)
+{
+    alarm_members_t *members = alarm_group_find (groups, alarm -> group_id);
+
+    members -> heap[alarm -> group_index].time = alarm -> time;
+    group_sift_up (members, alarm -> group_index);
+    group_sift_down (members, alarm -> group_index);
+}
+
+alarm_members_t *alarm_group_find (alarm_groups_t *groups, int group_id)
+{
+    alarm_members_t *members;
+
+    if (groups -> size == 0) {
+        return NULL;
+    }
+    for (members = groups -> buckets[group_hash (groups, group_id)];
+        members != NULL; members = members -> hash_link) {
+        if (members -> group_id == group_id) {
+            return members;
+        }
+    }
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ * alarm_group.h
+ *
+ * Index from group_id to the group's pending alarms, kept next to
+ * each shard's timer queue so that group-wide operations touch only
+ * the members of the group rather than every queued alarm.
+ *
+ * Each group keeps its members in a min-heap of (deadline, alarm)
+ * key records, like the heap backend's, with each alarm's slot in
+ * alarm_t.group_index. That gives the group's size and earliest
+ * deadline in O(1) and O(log n) insert, remove and update, without
+ * adding two list pointers to alarm_t, which fills its cache line
+ * already. Like the timer queue, the index does no locking.
+ *
+ * Built with -DNO_ALARM_GROUPS, there is no index: the routines
+ * below do nothing, and a scheduler finds a group's alarms by
+ * walking all of its alarms instead, so that only group cancels and
+ * listings pay, rather than every start, change and expiry.
+ */
+#ifndef __alarm_group_h
+#define __alarm_group_h
+
+#include "alarm_queue.h"
+
+/*
+ * One group's members: "count" entries of "heap", the earliest
+ * (with the group's earliest deadline) in heap[0] and the rest in
+ * no useful order.
+ */
+typedef struct alarm_members_tag {
+    struct alarm_members_tag *hash_link;
+    int                 group_id;
+    int                 count;
+    int                 capacity;
+    alarm_heap_entry_t  *heap;
+} alarm_members_t;
+
+typedef struct alarm_groups_tag {
+    alarm_members_t     **buckets;
+    unsigned int        size;           /* power of two, or 0 */
+    unsigned int        count;          /* groups with members */
+} alarm_groups_t;
+
+#ifdef NO_ALARM_GROUPS
+
+# define alarm_group_insert(groups, alarm)
+# define alarm_group_remove(groups, alarm)
+# define alarm_group_update(groups, alarm)
+
+#else
+
+/*
+ * Add an alarm to the group named by its group_id, creating the
+ * group if need be; its time must be set.
+ */
+extern void alarm_group_insert (alarm_groups_t *groups, alarm_t *alarm);
+
+/*
+ * Drop an alarm from its group, which must still be the one its
+ * group_id names. A group that loses its last member is freed.
+ */
+extern void alarm_group_remove (alarm_groups_t *groups, alarm_t *alarm);
+
+/*
+ * Reorder an alarm within its group after its time has changed.
+ */
+extern void alarm_group_update (alarm_groups_t *groups, alarm_t *alarm);
+
+/*
+ * Return the members of a group, or NULL if it has no pending
+ * alarms. The result is valid until the group is next changed.
+ */
+extern alarm_members_t *alarm_group_find (alarm_groups_t *groups, int group_id);
+
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * alarm_index.c
+ *
+ * Chained hash table keyed by alarm_id. The table doubles when the
+ * load factor reaches one, so chains stay short and every
+ * operation is O(1) expected.
+ */
+#include "errors.h"
+#include "alarm_index.h"
+
+/*
+ * Spread sequential ids across the table (Fibonacci hashing).
+ */
+static unsigned int alarm_index_hash (alarm_index_t *index, int alarm_id)
+{
+    return ((unsigned int) alarm_id * 2654435769u) & (index -> size - 1);
+}
+
+/*
+ * Double the bucket array and rehash every chain into it.
+ */
+static void alarm_index_grow (alarm_index_t *index)
+{
+    alarm_t **old = index -> buckets, *alarm, *next;
+    unsigned int old_size = index -> size, bucket;
+
+    index -> size = old_size ? old_size * 2 : 64;
+    index -> buckets = calloc (index -> size, sizeof (alarm_t*));
+    if (index -> buckets == NULL) {
+        errno_abort ("Grow alarm index");
+    }
+    for (bucket = 0; bucket < old_size; bucket++) {
+        for (alarm = old[bucket]; alarm != NULL; alarm = next) {
+            unsigned int hash = alarm_index_hash (index, alarm -> alarm_id);
+
+            next = alarm -> hash_link;
+            alarm -> hash_link = index -> buckets[hash];
+            index -> buckets[hash] = alarm;
+        }
+    }
+    free (old);
+}
+
+void alarm_index_insert (alarm_index_t *index, alarm_t *alarm)
+{
+    unsigned int hash;
+
+    if (index -> count >= index -> size) {
+        alarm_index_grow (index);
+    }
+    hash = alarm_index_hash (index, alarm -> alarm_id);
+    alarm -> hash_link = index -> buckets[hash];
+    index -> buckets[hash] = alarm;
+    index -> count++;
+}
+
+void alarm_index_remove (alarm_index_t *index, alarm_t *alarm)
+{
+    alarm_t **last = &index -> buckets[alarm_index_hash (index, alarm -> alarm_id)];
+
+    while (*last != NULL) {
+        if (*last == alarm) {
+            *last = alarm -> hash_link;
+            alarm -> hash_link = NULL;
+            index -> count--;
+            return;
+        }
+        last = &(*last) -> hash_link;
+    }
+}
+
+alarm_t *alarm_index_find (alarm_index_t *index, int alarm_id)
+{
+    alarm_t *alarm;
+
+    if (index -> size == 0) {
+        return NULL;
+    }
+    for (alarm = index -> buckets[alarm_index_hash (index, alarm_id)];
+        alarm != NULL; alarm = alarm -> hash_link) {
+        if (alarm -> alarm_id == alarm_id) {
+            return alarm;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,37 @@
+/*
+ * alarm_index.h
+ *
+ * Hash index from alarm_id to the alarm itself, so commands that
+ * name an alarm can find it in constant time instead of walking
+ * the timer queue. Chains are threaded through alarm_t.hash_link,
+ * so indexing an alarm never allocates. Like the timer queue, the
+ * index does no locking of its own.
+ */
+#ifndef __alarm_index_h
+#define __alarm_index_h
+
+#include "alarm_queue.h"
+
+typedef struct alarm_index_tag {
+    alarm_t             **buckets;
+    unsigned int        size;           /* power of two, or 0 */
+    unsigned int        count;
+} alarm_index_t;
+
+/*
+ * Add an alarm under its alarm_id. The caller guarantees that no
+ * other indexed alarm has the same alarm_id.
+ */
+extern void alarm_index_insert (alarm_index_t *index, alarm_t *alarm);
+
+/*
+ * Drop an indexed alarm from the index.
+ */
+extern void alarm_index_remove (alarm_index_t *index, alarm_t *alarm);
+
+/*
+ * Return the alarm with the given alarm_id, or NULL.
+ */
+extern alarm_t *alarm_index_find (alarm_index_t *index, int alarm_id);
+
+#endif
@@ -0,0 +1,284 @@
+/*
+ * alarm_message.c
+ *
+ * Each block starts with a one-byte size class and a count of the
+ * extra holders alarm_message_share has added, followed by the
+ * text. Classes are powers of two from 16 to 2048 bytes.
+ *
+ * As in alarm_pool.c, each thread caches free blocks of each class
+ * on a private list, chained through the handle stored just after
+ * the header, and exchanges batches of MESSAGE_BATCH with a depot.
+ * The depot keeps whole batches per class, chained through the
+ * handle after that in each batch's first block; it and the chunks
+ * are all message_mutex protects, so storing and releasing a
+ * message normally take no lock -- messages are stored by main and
+ * released by the alarm thread, and meet in the depot. The share
+ * count is atomic, since any holder may share or release.
+ *
+ * The arena holds at most MESSAGE_CHUNKS chunks. Once it is full a
+ * store fails, though blocks of a class can still sit free in other
+ * threads' caches, at most two batches each.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include "errors.h"
+#include "alarm_message.h"
+#include "alarm_stats.h"
+
+#define MESSAGE_ALIGN           16
+#define MESSAGE_CHUNK           (1 << 20)       /* bytes per chunk */
+#define MESSAGE_CHUNK_BITS      16              /* offset bits in a handle */
+#define MESSAGE_CHUNKS          4096
+#define MESSAGE_CLASSES         8               /* 16 .. 2048 bytes */
+#define MESSAGE_SHARES          255     /* most extra holders of a block */
+#define MESSAGE_BATCH           32      /* blocks moved to or from the depot */
+
+typedef struct message_header_tag {
+    unsigned char       class;
+    atomic_uchar        shares;         /* extra holders */
+} message_header_t;
+
+#define MESSAGE_HEADER          sizeof (message_header_t)
+
+/*
+ * Where in a free block the links are kept.
+ */
+#define MESSAGE_NEXT            0       /* next free block */
+#define MESSAGE_BATCHES         1       /* next batch in the depot */
+
+static pthread_mutex_t message_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *message_chunks[MESSAGE_CHUNKS];
+static int message_chunk_count = 0;
+static size_t message_chunk_used = MESSAGE_CHUNK;   /* in the last chunk */
+static alarm_message_t message_depot[MESSAGE_CLASSES];     /* full batches */
+
+static __thread alarm_message_t message_cache[MESSAGE_CLASSES];
+static __thread int message_cached[MESSAGE_CLASSES];
+
+static char *message_block (alarm_message_t message)
+{
+    return message_chunks[message >> MESSAGE_CHUNK_BITS]
+        + (size_t) (message & ((1 << MESSAGE_CHUNK_BITS) - 1)) * MESSAGE_ALIGN;
+}
+
+static alarm_message_t message_link (alarm_message_t message, int which)
+{
+    alarm_message_t link;
+
+    memcpy (&link, message_block (message) + MESSAGE_HEADER + which * sizeof (link),
+        sizeof (link));
+    return link;
+}
+
+static void message_set_link (alarm_message_t message, int which, alarm_message_t link)
+{
+    memcpy (message_block (message) + MESSAGE_HEADER + which * sizeof (link), &link,
+        sizeof (link));
+}
+
+/*
+ * Smallest class whose blocks hold "size" bytes.
+ */
+static int message_class (size_t size)
+{
+    int class = 0;
+
+    while (((size_t) MESSAGE_ALIGN << class) < size) {
+        class++;
+    }
+    return class;
+}
+
+/*
+ * Carve a new block of the given class from the current chunk,
+ * starting a new chunk when it is full; 0 if the arena is full, or
+ * no memory can be had for another chunk. Caller holds
+ * message_mutex.
+ */
+static alarm_message_t message_carve (int class)
+{
+    size_t size = (size_t) MESSAGE_ALIGN << class;
+    alarm_message_t message;
+
+    if (message_chunk_used + size > MESSAGE_CHUNK) {
+        if (message_chunk_count == MESSAGE_CHUNKS) {
+            return 0;
+        }
+        message_chunks[message_chunk_count] = malloc (MESSAGE_CHUNK);
+        if (message_chunks[message_chunk_count] == NULL) {
+            return 0;
+        }
+        message_chunk_count++;
+
+        // Offset 0 of chunk 0 would be handle 0, so skip it
+        message_chunk_used = message_chunk_count == 1 ? MESSAGE_ALIGN : 0;
+    }
+    message = ((alarm_message_t) (message_chunk_count - 1) << MESSAGE_CHUNK_BITS)
+        | (alarm_message_t) (message_chunk_used / MESSAGE_ALIGN);
+    message_chunk_used += size;
+    return message;
+}
+
+/*
+ * Refill an empty thread cache of a class with a batch from the
+ * depot, or with up to a batch carved afresh. Returns 0 if not one
+ * block could be had.
+ */
+static int message_refill (int class)
+{
+    alarm_message_t batch, message;
+    int status, count;
+    STATS_TIMER (timer);
+
+    STATS_START (timer);
+    status = pthread_mutex_lock (&message_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    STATS_WAIT (ALARM_SITE_MESSAGE, timer);
+    batch = message_depot[class];
+    if (batch != 0) {
+        message_depot[class] = message_link (batch, MESSAGE_BATCHES);
+        count = MESSAGE_BATCH;
+    } else {
+        for (count = 0; count < MESSAGE_BATCH; count++) {
+            message = message_carve (class);
+            if (message == 0) {
+                break;
+            }
+            message_set_link (message, MESSAGE_NEXT, batch);
+            batch = message;
+        }
+    }
+    STATS_HOLD (ALARM_SITE_MESSAGE, timer);
+    status = pthread_mutex_unlock (&message_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    message_cache[class] = batch;
+    message_cached[class] = count;
+    return count;
+}
+
+/*
+ * Move one batch from an overfull thread cache of a class to the
+ * depot.
+ */
+static void message_flush (int class)
+{
+    alarm_message_t batch = message_cache[class], last = batch;
+    int status, index;
+    STATS_TIMER (timer);
+
+    for (index = 1; index < MESSAGE_BATCH; index++) {
+        last = message_link (last, MESSAGE_NEXT);
+    }
+    message_cache[class] = message_link (last, MESSAGE_NEXT);
+    message_cached[class] -= MESSAGE_BATCH;
+    message_set_link (last, MESSAGE_NEXT, 0);
+
+    STATS_START (timer);
+    status = pthread_mutex_lock (&message_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    STATS_WAIT (ALARM_SITE_MESSAGE, timer);
+    message_set_link (batch, MESSAGE_BATCHES, message_depot[class]);
+    message_depot[class] = batch;
+    STATS_HOLD (ALARM_SITE_MESSAGE, timer);
+    status = pthread_mutex_unlock (&message_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+alarm_message_t alarm_message_store (const char *text, size_t length)
+{
+    alarm_message_t message;
+    message_header_t *header;
+    char *block;
+    int class;
+
+    if (length > ALARM_MESSAGE_MAX) {
+        length = ALARM_MESSAGE_MAX;
+    }
+    class = message_class (MESSAGE_HEADER + length + 1);
+    if (message_cache[class] == 0 && message_refill (class) == 0) {
+        return 0;
+    }
+    message = message_cache[class];
+    message_cache[class] = message_link (message, MESSAGE_NEXT);
+    message_cached[class]--;
+
+    block = message_block (message);
+    header = (message_header_t*) block;
+    header -> class = class;
+    atomic_init (&header -> shares, 0);
+    memcpy (block + MESSAGE_HEADER, text, length);
+    block[MESSAGE_HEADER + length] = '\0';
+    return message;
+}
+
+const char *alarm_message_text (alarm_message_t message)
+{
+    if (message == 0) {
+        return "";
+    }
+    return message_block (message) + MESSAGE_HEADER;
+}
+
+size_t alarm_message_size (alarm_message_t message)
+{
+    if (message == 0) {
+        return 0;
+    }
+    return (size_t) MESSAGE_ALIGN << ((message_header_t*) message_block (message)) -> class;
+}
+
+alarm_message_t alarm_message_share (alarm_message_t message)
+{
+    message_header_t *header;
+    unsigned char shares;
+
+    if (message == 0) {
+        return 0;
+    }
+    header = (message_header_t*) message_block (message);
+    shares = atomic_load (&header -> shares);
+    do {
+        // Held as often as it can count: the new holder gets a copy
+        if (shares == MESSAGE_SHARES) {
+            return alarm_message_store (alarm_message_text (message),
+                strlen (alarm_message_text (message)));
+        }
+    } while (!atomic_compare_exchange_weak (&header -> shares, &shares, shares + 1));
+    return message;
+}
+
+void alarm_message_release (alarm_message_t message)
+{
+    message_header_t *header;
+    unsigned char shares;
+    int class;
+
+    if (message == 0) {
+        return;
+    }
+    header = (message_header_t*) message_block (message);
+
+    // Another holder keeps the block
+    shares = atomic_load (&header -> shares);
+    while (shares != 0) {
+        if (atomic_compare_exchange_weak (&header -> shares, &shares, shares - 1)) {
+            return;
+        }
+    }
+
+    // The last holder: nobody else can share it now
+    class = header -> class;
+    message_set_link (message, MESSAGE_NEXT, message_cache[class]);
+    message_cache[class] = message;
+    if (++message_cached[class] >= 2 * MESSAGE_BATCH) {
+        message_flush (class);
+    }
+}
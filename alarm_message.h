@@ -0,0 +1,60 @@
+/*
+ * alarm_message.h
+ *
+ * Out-of-line storage for alarm message text. The scheduler's
+ * alarm_t carries only a 32-bit handle, so walking the timer queue
+ * never pulls message bytes through the cache, and messages are no
+ * longer cut down to fit a fixed array in every alarm.
+ *
+ * Text is kept in size-classed blocks carved from large chunks. A
+ * handle names a chunk and a 16-byte-aligned offset within it;
+ * chunks are never moved or freed, so a handle stays valid until
+ * it is released, whichever thread looks it up. Free blocks are
+ * cached per thread, so storing and releasing a message normally
+ * take no lock.
+ */
+#ifndef __alarm_message_h
+#define __alarm_message_h
+
+#include <stddef.h>
+
+/*
+ * Longest message accepted, not counting the terminating null.
+ */
+#define ALARM_MESSAGE_MAX       1023
+
+typedef unsigned int alarm_message_t;   /* 0 is "no message" */
+
+/*
+ * Copy "length" bytes of text (truncated to ALARM_MESSAGE_MAX)
+ * into the arena and return its handle, or 0 if the arena is full
+ * (4GB of blocks), so the caller can refuse the alarm.
+ */
+extern alarm_message_t alarm_message_store (const char *text, size_t length);
+
+/*
+ * Return the null-terminated text for a handle; "" for 0.
+ */
+extern const char *alarm_message_text (alarm_message_t message);
+
+/*
+ * Return a handle to the same text for another holder, who must
+ * release it too; the storage goes back to the arena when the last
+ * holder releases it. The handle is normally the same one, and is
+ * a copy only for a message already held very many times -- or 0,
+ * which reads as "", if that copy finds the arena full.
+ */
+extern alarm_message_t alarm_message_share (alarm_message_t message);
+
+/*
+ * Bytes of arena a message's block takes up; 0 for 0.
+ */
+extern size_t alarm_message_size (alarm_message_t message);
+
+/*
+ * Give up a hold on a message, giving its storage back to the
+ * arena if it was the last. Releasing 0 does nothing.
+ */
+extern void alarm_message_release (alarm_message_t message);
+
+#endif
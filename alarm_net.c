@@ -0,0 +1,310 @@
+/*
+ * alarm_net.c
+ *
+ * The event thread waits in epoll_wait on the listening sockets and
+ * every connection, level-triggered. A ready listener is drained
+ * with accept4 until it would block; a ready connection gets one
+ * read per wake-up, so a client that never stops sending cannot
+ * starve the rest.
+ *
+ * Each connection keeps the tail of its input that has no newline
+ * yet; everything before the last newline is handed to the command
+ * routine a line at a time, straight from the buffer, however many
+ * lines arrived in the read. A line that won't fit in the buffer is answered with an
+ * error and skipped.
+ *
+ * Connections, like all clients, are non-blocking, so the output
+ * stage drops notifications for a client that stops reading rather
+ * than stalling everyone else.
+ */
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "errors.h"
+#include "alarm_net.h"
+#include "alarm_output.h"
+
+#define NET_BUFFER      16384   /* longest line plus newline */
+#define NET_EVENTS      256     /* events per epoll_wait */
+
+typedef struct net_conn_tag {
+    int                 fd;
+    int                 listener;       /* accept, don't read */
+    int                 discard;        /* skipping an overlong line */
+    int                 used;           /* bytes in "buffer" */
+    char                buffer[NET_BUFFER];
+} net_conn_t;
+
+static int net_epoll = -1;
+static alarm_net_command_t net_command = NULL;
+
+/*
+ * Add a descriptor to the event set, with a net_conn_t for it.
+ */
+static net_conn_t *net_add (int fd, int listener)
+{
+    net_conn_t *conn = (net_conn_t*)malloc (listener
+        ? offsetof (net_conn_t, buffer) : sizeof (net_conn_t));
+    struct epoll_event event;
+
+    if (conn == NULL) {
+        errno_abort ("Allocate connection");
+    }
+    conn -> fd = fd;
+    conn -> listener = listener;
+    conn -> discard = 0;
+    conn -> used = 0;
+    event.events = EPOLLIN;
+    event.data.ptr = conn;
+    if (epoll_ctl (net_epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+        errno_abort ("Add to epoll");
+    }
+    return conn;
+}
+
+/*
+ * Forget a connection whose client has finished sending. Output
+ * already owed to it still gets written; the output stage closes
+ * the descriptor when the last of it has been.
+ */
+static void net_disconnect (net_conn_t *conn)
+{
+    if (epoll_ctl (net_epoll, EPOLL_CTL_DEL, conn -> fd, NULL) != 0) {
+        errno_abort ("Remove from epoll");
+    }
+    alarm_output_close (conn -> fd);
+    free (conn);
+}
+
+/*
+ * Accept every pending connection on a listener.
+ */
+static void net_accept (net_conn_t *listener)
+{
+    int fd;
+
+    while (1) {
+        fd = accept4 (listener -> fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror ("Accept connection");
+            }
+            return;
+        }
+        alarm_output_open (fd);
+        net_add (fd, 0);
+    }
+}
+
+/*
+ * Read what a client has sent and run every complete line.
+ */
+static void net_read (net_conn_t *conn)
+{
+    char *start, *end, *newline;
+    size_t length;
+    ssize_t count;
+
+    count = read (conn -> fd, conn -> buffer + conn -> used, NET_BUFFER - conn -> used);
+    if (count < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    // At end of input, a last line without a newline still counts
+    if (count <= 0) {
+        if (count == 0 && conn -> used > 0 && !conn -> discard) {
+            net_command (conn -> buffer, conn -> used, conn -> fd);
+        }
+        net_disconnect (conn);
+        return;
+    }
+
+    start = conn -> buffer;
+    end = conn -> buffer + conn -> used + count;
+    while ((newline = memchr (start, '\n', end - start)) != NULL) {
+        length = newline - start;
+        if (length > 0 && start[length - 1] == '\r') {
+            length--;
+        }
+        if (conn -> discard) {
+            conn -> discard = 0;
+        } else {
+            net_command (start, length, conn -> fd);
+        }
+        start = newline + 1;
+    }
+
+    // Keep the unfinished line for the next read
+    conn -> used = end - start;
+    if (conn -> used == NET_BUFFER) {
+        if (!conn -> discard) {
+            alarm_output_fd (conn -> fd, "Command too long\n");
+        }
+        conn -> discard = 1;
+        conn -> used = 0;
+    } else if (start != conn -> buffer) {
+        memmove (conn -> buffer, start, conn -> used);
+    }
+}
+
+/*
+ * The event thread's start routine.
+ */
+static void *net_thread (void *arg)
+{
+    struct epoll_event events[NET_EVENTS];
+    net_conn_t *conn;
+    int count, index;
+
+    while (1) {
+        count = epoll_wait (net_epoll, events, NET_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errno_abort ("Wait on epoll");
+        }
+        for (index = 0; index < count; index++) {
+            conn = events[index].data.ptr;
+            if (conn -> listener) {
+                net_accept (conn);
+            } else {
+                net_read (conn);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Create, bind and listen on a socket for "address".
+ */
+static int net_socket (const char *address)
+{
+    struct addrinfo hints, *info, *addr;
+    struct sockaddr_un local;
+    struct stat existing;
+    char host[256];
+    const char *port;
+    int fd = -1, on = 1, status;
+
+    if (strchr (address, '/') != NULL) {
+        if (strlen (address) >= sizeof (local.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset (&local, 0, sizeof (local));
+        local.sun_family = AF_UNIX;
+        strcpy (local.sun_path, address);
+        fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        /*
+         * Remove a stale socket from an earlier run, but nothing
+         * else: bind fails on any other file in the way.
+         */
+        if (lstat (address, &existing) == 0 && S_ISSOCK (existing.st_mode)
+            && unlink (address) != 0) {
+            close (fd);
+            return -1;
+        }
+        if (bind (fd, (struct sockaddr *) &local, sizeof (local)) != 0
+            || listen (fd, SOMAXCONN) != 0) {
+            close (fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // "[host:]port", listening on every interface if no host
+    port = strrchr (address, ':');
+    if (port == NULL) {
+        port = address;
+        host[0] = '\0';
+    } else {
+        snprintf (host, sizeof (host), "%.*s", (int) (port - address), address);
+        port++;
+    }
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    status = getaddrinfo (host[0] != '\0' ? host : NULL, port, &hints, &info);
+    if (status != 0) {
+        errno = EADDRNOTAVAIL;
+        return -1;
+    }
+    for (addr = info; addr != NULL; addr = addr -> ai_next) {
+        fd = socket (addr -> ai_family, addr -> ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+            addr -> ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on));
+        if (bind (fd, addr -> ai_addr, addr -> ai_addrlen) == 0
+            && listen (fd, SOMAXCONN) == 0) {
+            break;
+        }
+        close (fd);
+        fd = -1;
+    }
+    freeaddrinfo (info);
+    return fd;
+}
+
+int alarm_net_listen (const char *address)
+{
+    struct rlimit limit;
+    int fd;
+
+    if (net_epoll < 0) {
+        net_epoll = epoll_create1 (EPOLL_CLOEXEC);
+        if (net_epoll < 0) {
+            return -1;
+        }
+
+        // Every client is a descriptor, so allow as many as we may
+        if (getrlimit (RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit (RLIMIT_NOFILE, &limit);
+        }
+    }
+    fd = net_socket (address);
+    if (fd < 0) {
+        return -1;
+    }
+    net_add (fd, 1);
+    return 0;
+}
+
+void alarm_net_start (alarm_net_command_t command)
+{
+    pthread_t thread;
+    int status;
+
+    /*
+     * A client that disconnects with output still owed to it must
+     * not kill the process when that output is written.
+     */
+    signal (SIGPIPE, SIG_IGN);
+    net_command = command;
+    status = pthread_create (&thread, NULL, net_thread, NULL);
+    if (status != 0) {
+        err_abort (status, "Create network thread");
+    }
+    status = pthread_detach (thread);
+    if (status != 0) {
+        err_abort (status, "Detach network thread");
+    }
+}
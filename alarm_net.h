@@ -0,0 +1,42 @@
+/*
+ * alarm_net.h
+ *
+ * Network front end. Clients connect over TCP or a Unix-domain
+ * socket and send the same commands as the terminal, one per line;
+ * a single event thread multiplexes every connection with epoll,
+ * so thousands of clients cost one thread, and it hands over every
+ * complete line a read brings in, so a client may pipeline as many
+ * commands as it likes per write.
+ *
+ * Each connection is identified to the command routine by its
+ * descriptor, which is reference counted by the output stage
+ * (alarm_output.h): replies and expired alarms are written back on
+ * the connection that asked for them, and the descriptor is closed
+ * only after the last of them has been written.
+ */
+#ifndef __alarm_net_h
+#define __alarm_net_h
+
+#include <stddef.h>
+
+/*
+ * Receives one command line of "length" bytes, without its newline
+ * and not null-terminated, from the client on descriptor "client".
+ * It is called from the event thread, so it should not block.
+ */
+typedef void (*alarm_net_command_t) (const char *line, size_t length, int client);
+
+/*
+ * Listen on "address": a path (anything containing a '/') for a
+ * Unix-domain socket, otherwise "[host:]port" for TCP. May be
+ * called more than once, before alarm_net_start. Returns 0, or -1
+ * with errno set.
+ */
+extern int alarm_net_listen (const char *address);
+
+/*
+ * Start the event thread. alarm_output_start must have been called.
+ */
+extern void alarm_net_start (alarm_net_command_t command);
+
+#endif
@@ -0,0 +1,378 @@
+/*
+ * alarm_output.c
+ *
+ * The ring is a bounded multi-producer queue in the style of
+ * Dmitry Vyukov's: each slot carries a sequence number that says
+ * whether it is free for the producer claiming position "pos"
+ * (sequence == pos) or holds a record ready for the consumer
+ * (sequence == pos + 1). Producers claim positions with a
+ * compare-and-swap on "tail"; the single writer thread owns "head".
+ *
+ * Each record names the file descriptor it is for; the writer sends
+ * each run of consecutive records for the same descriptor with one
+ * writev. A record with a negative length is a request to close the
+ * descriptor, queued by whoever dropped the last reference to a
+ * client, so it is written after everything queued for it before.
+ *
+ * The writer sleeps on a POSIX semaphore only when the ring is
+ * empty, and producers post it only when the writer has said it
+ * is about to sleep, so a busy ring costs no system calls beyond
+ * the writev itself.
+ */
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_output.h"
+
+#define OUTPUT_MASK     (ALARM_OUTPUT_SLOTS - 1)
+#define OUTPUT_IOV      64      /* records per writev */
+#define OUTPUT_CLIENTS  (1 << 20)       /* most descriptors tracked */
+
+typedef struct output_slot_tag {
+    atomic_size_t       sequence;
+    int                 fd;
+    int                 length;
+    char                text[ALARM_OUTPUT_TEXT];
+} output_slot_t;
+
+static output_slot_t output_ring[ALARM_OUTPUT_SLOTS];
+static atomic_size_t output_tail;       /* next position to claim */
+static atomic_size_t output_head;       /* next position to write */
+static atomic_int output_sleeping;      /* writer is (about to be) idle */
+static atomic_ulong output_dropped;
+static sem_t output_wakeup;
+static int output_fd = -1;
+
+/*
+ * Reference counts for client descriptors, indexed by descriptor.
+ */
+typedef struct output_client_tag {
+    atomic_int          refs;
+    atomic_int          closing;        /* alarm_output_close called */
+} output_client_t;
+
+static output_client_t *output_clients = NULL;
+static int output_client_count = 0;
+
+/*
+ * Write every byte described by "iov", retrying short writes. A
+ * sink that has gone away (EPIPE, EBADF...) just discards output,
+ * and so does a non-blocking client that has stopped reading.
+ */
+static void output_writev (int fd, struct iovec *iov, int count)
+{
+    while (count > 0) {
+        ssize_t written = writev (fd, iov, count);
+
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                atomic_fetch_add (&output_dropped, count);
+            }
+            return;
+        }
+        while (count > 0 && (size_t) written >= iov -> iov_len) {
+            written -= iov -> iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov -> iov_base = (char *) iov -> iov_base + written;
+            iov -> iov_len -= written;
+        }
+    }
+}
+
+/*
+ * The writer thread's start routine: gather the run of ready
+ * records at the head of the ring, write them, then hand the slots
+ * back to producers.
+ */
+static void *output_thread (void *arg)
+{
+    struct iovec iov[OUTPUT_IOV];
+    size_t head = atomic_load (&output_head);
+    unsigned long dropped;
+    char notice[64];
+    int count, fd = -1;
+
+    while (1) {
+        for (count = 0; count < OUTPUT_IOV; count++) {
+            output_slot_t *slot = &output_ring[(head + count) & OUTPUT_MASK];
+
+            if (atomic_load_explicit (&slot -> sequence, memory_order_acquire)
+                != head + count + 1) {
+                break;
+            }
+            if (count == 0) {
+                fd = slot -> fd;
+            } else if (slot -> fd != fd) {
+                break;
+            }
+            if (slot -> length < 0) {
+                count++;        // a close ends the run
+                break;
+            }
+            iov[count].iov_base = slot -> text;
+            iov[count].iov_len = slot -> length;
+        }
+
+        if (count == 0) {
+            dropped = atomic_exchange (&output_dropped, 0);
+            if (dropped != 0) {
+                iov[0].iov_base = notice;
+                iov[0].iov_len = snprintf (notice, sizeof (notice),
+                    "[%lu notifications dropped]\n", dropped);
+                output_writev (output_fd, iov, 1);
+                continue;
+            }
+
+            /*
+             * Announce that we are going idle, then look once more
+             * so a record queued in between is not slept through.
+             */
+            atomic_store (&output_sleeping, 1);
+            if (atomic_load_explicit (&output_ring[head & OUTPUT_MASK].sequence,
+                    memory_order_acquire) == head + 1) {
+                atomic_store (&output_sleeping, 0);
+                continue;
+            }
+            while (sem_wait (&output_wakeup) != 0) {
+                if (errno != EINTR) {
+                    errno_abort ("Wait on output semaphore");
+                }
+            }
+            continue;
+        }
+
+        if (output_ring[(head + count - 1) & OUTPUT_MASK].length < 0) {
+            if (count > 1) {
+                output_writev (fd, iov, count - 1);
+            }
+            close (fd);
+        } else {
+            output_writev (fd, iov, count);
+        }
+        while (count-- > 0) {
+            atomic_store_explicit (&output_ring[head & OUTPUT_MASK].sequence,
+                head + ALARM_OUTPUT_SLOTS, memory_order_release);
+            head++;
+        }
+        atomic_store (&output_head, head);
+    }
+    return NULL;
+}
+
+/*
+ * Give the writer a short while to drain what is still queued when
+ * the process exits.
+ */
+static void output_flush (void)
+{
+    struct timespec pause = { 0, 1000000 };
+    int tries;
+
+    for (tries = 0; tries < 1000; tries++) {
+        if (atomic_load (&output_head) == atomic_load (&output_tail)) {
+            return;
+        }
+        nanosleep (&pause, NULL);
+    }
+}
+
+void alarm_output_start (int fd)
+{
+    pthread_t thread;
+    struct rlimit limit;
+    size_t index;
+    int status;
+
+    for (index = 0; index < ALARM_OUTPUT_SLOTS; index++) {
+        atomic_init (&output_ring[index].sequence, index);
+    }
+    output_fd = fd;
+
+    /*
+     * Track every descriptor the process could be allowed to open,
+     * since alarm_net raises the soft limit to the hard one. The
+     * table is zero-filled, so untouched pages cost nothing.
+     */
+    output_client_count = OUTPUT_CLIENTS;
+    if (getrlimit (RLIMIT_NOFILE, &limit) == 0
+        && limit.rlim_max != RLIM_INFINITY && limit.rlim_max < OUTPUT_CLIENTS) {
+        output_client_count = limit.rlim_max;
+    }
+    output_clients = (output_client_t*)calloc (output_client_count, sizeof (output_client_t));
+    if (output_clients == NULL) {
+        errno_abort ("Allocate output clients");
+    }
+    if (sem_init (&output_wakeup, 0, 0) != 0) {
+        errno_abort ("Init output semaphore");
+    }
+    status = pthread_create (&thread, NULL, output_thread, NULL);
+    if (status != 0) {
+        err_abort (status, "Create output thread");
+    }
+    status = pthread_detach (thread);
+    if (status != 0) {
+        err_abort (status, "Detach output thread");
+    }
+    atexit (output_flush);
+}
+
+/*
+ * Claim the slot at the tail and return it, with its position in
+ * "pos", or return NULL if the ring is full.
+ */
+static output_slot_t *output_claim (size_t *pos)
+{
+    output_slot_t *slot;
+    size_t sequence;
+
+    *pos = atomic_load_explicit (&output_tail, memory_order_relaxed);
+    while (1) {
+        slot = &output_ring[*pos & OUTPUT_MASK];
+        sequence = atomic_load_explicit (&slot -> sequence, memory_order_acquire);
+        if (sequence == *pos) {
+            if (atomic_compare_exchange_weak (&output_tail, pos, *pos + 1)) {
+                return slot;
+            }
+        } else if ((long) (sequence - *pos) < 0) {
+            return NULL;
+        } else {
+            *pos = atomic_load_explicit (&output_tail, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Hand a filled slot to the writer, waking it if it is idle.
+ */
+static void output_publish (output_slot_t *slot, size_t pos, int fd, int length)
+{
+    slot -> fd = fd;
+    slot -> length = length;
+    atomic_store_explicit (&slot -> sequence, pos + 1, memory_order_release);
+
+    if (atomic_exchange (&output_sleeping, 0)) {
+        if (sem_post (&output_wakeup) != 0) {
+            errno_abort ("Post output semaphore");
+        }
+    }
+}
+
+/*
+ * Claim a slot, format into it and publish it. If the ring is full,
+ * drop the notification or, with "wait", wait for the writer to
+ * make room.
+ */
+static void output_queue (int fd, int wait, const char *format, va_list args)
+{
+    struct timespec pause = { 0, 1000000 };
+    output_slot_t *slot;
+    size_t pos;
+    int length;
+
+    while ((slot = output_claim (&pos)) == NULL) {
+        if (!wait) {
+            atomic_fetch_add (&output_dropped, 1);
+            return;
+        }
+        nanosleep (&pause, NULL);
+    }
+
+    // Format straight into the slot, then publish it
+    length = vsnprintf (slot -> text, sizeof (slot -> text), format, args);
+    if (length < 0) {
+        length = 0;
+    } else if (length >= (int) sizeof (slot -> text)) {
+        length = sizeof (slot -> text) - 1;
+        slot -> text[length - 1] = '\n';
+    }
+    output_publish (slot, pos, fd, length);
+}
+
+/*
+ * Queue the request to close a client whose last reference is gone.
+ * Unlike a notification it can't be dropped, or the descriptor would
+ * leak, so wait for the writer to make room.
+ */
+static void output_close (int fd)
+{
+    struct timespec pause = { 0, 1000000 };
+    output_slot_t *slot;
+    size_t pos;
+
+    while ((slot = output_claim (&pos)) == NULL) {
+        nanosleep (&pause, NULL);
+    }
+    output_publish (slot, pos, fd, -1);
+}
+
+void alarm_output (const char *format, ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    output_queue (output_fd, 0, format, args);
+    va_end (args);
+}
+
+void alarm_output_fd (int fd, const char *format, ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    output_queue (fd, 0, format, args);
+    va_end (args);
+}
+
+void alarm_output_wait (int fd, const char *format, ...)
+{
+    va_list args;
+
+    va_start (args, format);
+    output_queue (fd, 1, format, args);
+    va_end (args);
+}
+
+void alarm_output_open (int fd)
+{
+    if (fd >= 0 && fd < output_client_count) {
+        atomic_store (&output_clients[fd].closing, 0);
+        atomic_store (&output_clients[fd].refs, 1);
+    }
+}
+
+void alarm_output_hold (int fd)
+{
+    if (fd >= 0 && fd < output_client_count) {
+        atomic_fetch_add (&output_clients[fd].refs, 1);
+    }
+}
+
+void alarm_output_release (int fd)
+{
+    if (fd >= 0 && fd < output_client_count
+        && atomic_fetch_sub (&output_clients[fd].refs, 1) == 1
+        && atomic_load (&output_clients[fd].closing)) {
+        output_close (fd);
+    }
+}
+
+void alarm_output_close (int fd)
+{
+    if (fd >= 0 && fd < output_client_count) {
+        atomic_store (&output_clients[fd].closing, 1);
+        alarm_output_release (fd);
+    } else {
+        close (fd);
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * alarm_output.h
+ *
+ * Asynchronous output stage. Threads that must not block on a slow
+ * terminal, pipe or log sink -- the alarm thread and anything that
+ * holds alarm_mutex -- format their notifications into a lock-free
+ * multi-producer ring buffer instead of calling printf. A writer
+ * thread drains the ring and hands whole runs of records to the
+ * sink with a single writev, so producers never wait on the sink.
+ *
+ * If the sink falls so far behind that the ring fills, new
+ * notifications are dropped (and counted) rather than stalling the
+ * producer; the writer reports how many were lost.
+ */
+#ifndef __alarm_output_h
+#define __alarm_output_h
+
+#include "alarm_message.h"
+
+/*
+ * Ring geometry. ALARM_OUTPUT_SLOTS must be a power of two; a
+ * notification longer than ALARM_OUTPUT_TEXT bytes is truncated,
+ * which leaves room for a full-length message plus its prefix.
+ */
+#define ALARM_OUTPUT_SLOTS      2048
+#define ALARM_OUTPUT_TEXT       (ALARM_MESSAGE_MAX + 129)
+
+/*
+ * Start the writer thread, writing to file descriptor "fd" unless a
+ * notification names another. Must be
+ * called once, before any notification is queued. Notifications
+ * still queued when the process exits are flushed by an atexit
+ * handler.
+ */
+extern void alarm_output_start (int fd);
+
+/*
+ * Queue a printf-style notification for the file descriptor given
+ * to alarm_output_start. Never blocks.
+ */
+extern void alarm_output (const char *format, ...)
+    __attribute__ ((format (printf, 1, 2)));
+
+/*
+ * Queue a printf-style notification for a specific file descriptor
+ * (stderr, say). Never blocks.
+ */
+extern void alarm_output_fd (int fd, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/*
+ * As alarm_output_fd, but if the ring is full, wait for room rather
+ * than drop the notification. Only for threads that may block, such
+ * as one writing out a long listing.
+ */
+extern void alarm_output_wait (int fd, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+/*
+ * Client descriptors (network connections) are reference counted so
+ * that a descriptor is closed only once nothing more can be written
+ * to it. alarm_output_open gives a new client one reference, owned
+ * by whoever reads from it; every alarm or request that may later
+ * produce output for the client holds another. alarm_output_close
+ * drops the reader's reference, and whoever drops the last one
+ * queues the close behind everything already queued for the client.
+ * Descriptors never opened this way (stdout, stderr) may be held and
+ * released too; they are never closed.
+ */
+extern void alarm_output_open (int fd);
+extern void alarm_output_hold (int fd);
+extern void alarm_output_release (int fd);
+extern void alarm_output_close (int fd);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * alarm_parse.c
+ *
+ * Each helper takes the cursor by reference and advances it past
+ * what it accepted, returning 0, or -1 if the text there doesn't
+ * match (leaving the cursor wherever it stopped, since the caller
+ * gives up on the line anyway).
+ */
+#include <limits.h>
+#include <string.h>
+#include "alarm_parse.h"
+
+#define PARSE_NAME_MAX  15      /* longest command name considered */
+
+static const struct {
+    const char          *name;
+    int                 type;
+} parse_commands[] = {
+    { "Start_Alarm",    ALARM_COMMAND_START },
+    { "Start_Periodic_Alarm", ALARM_COMMAND_PERIODIC },
+    { "Change_Alarm",   ALARM_COMMAND_CHANGE },
+    { "Cancel_Alarm",   ALARM_COMMAND_CANCEL },
+    { "Cancel_Group",   ALARM_COMMAND_CANCEL_GROUP },
+    { "List_Alarms",    ALARM_COMMAND_LIST },
+    { "List_Group",     ALARM_COMMAND_LIST_GROUP },
+    { "Stats",          ALARM_COMMAND_STATS },
+};
+
+static int parse_is_blank (char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static void parse_blanks (const char **cursor, const char *end)
+{
+    while (*cursor < end && parse_is_blank (**cursor)) {
+        (*cursor)++;
+    }
+}
+
+/*
+ * Accept the literal "text".
+ */
+static int parse_literal (const char **cursor, const char *end, const char *text)
+{
+    size_t length = strlen (text);
+
+    if ((size_t) (end - *cursor) < length || memcmp (*cursor, text, length) != 0) {
+        return -1;
+    }
+    *cursor += length;
+    return 0;
+}
+
+/*
+ * Accept a decimal int, after optional blanks and sign.
+ */
+static int parse_int (const char **cursor, const char *end, int *value)
+{
+    long long result = 0;
+    int negative = 0;
+    const char *digits;
+
+    parse_blanks (cursor, end);
+    if (*cursor < end && (**cursor == '-' || **cursor == '+')) {
+        negative = **cursor == '-';
+        (*cursor)++;
+    }
+    digits = *cursor;
+    while (*cursor < end && **cursor >= '0' && **cursor <= '9') {
+        result = result * 10 + (**cursor - '0');
+        if (result > (long long) INT_MAX + 1) {
+            return -1;
+        }
+        (*cursor)++;
+    }
+    if (*cursor == digits || (!negative && result > INT_MAX)) {
+        return -1;
+    }
+    *value = (int) (negative ? -result : result);
+    return 0;
+}
+
+int alarm_parse_duration (const char *text, size_t length, alarm_time_t *duration)
+{
+    const char *cursor = text, *end = text + length, *unit;
+    long long whole = 0, fraction = 0, fraction_scale = 1, scale;
+    int digits = 0;
+
+    while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+        if (whole > LLONG_MAX / 10) {
+            return -1;
+        }
+        whole = whole * 10 + (*cursor++ - '0');
+        digits++;
+    }
+    if (cursor < end && *cursor == '.') {
+        cursor++;
+        while (cursor < end && *cursor >= '0' && *cursor <= '9') {
+            // Digits past a nanosecond can't change the result
+            if (fraction_scale < ALARM_NSEC_PER_SEC) {
+                fraction = fraction * 10 + (*cursor - '0');
+                fraction_scale *= 10;
+            }
+            cursor++;
+            digits++;
+        }
+    }
+    if (digits == 0) {
+        return -1;
+    }
+
+    unit = cursor;
+    if (end - unit == 0 || (end - unit == 1 && *unit == 's')) {
+        scale = ALARM_NSEC_PER_SEC;
+    } else if (end - unit == 2 && unit[0] == 'm' && unit[1] == 's') {
+        scale = ALARM_NSEC_PER_MSEC;
+    } else if (end - unit == 2 && unit[0] == 'u' && unit[1] == 's') {
+        scale = 1000;
+    } else {
+        return -1;
+    }
+    if (whole > LLONG_MAX / scale - 1) {
+        return -1;
+    }
+    *duration = whole * scale + (fraction * scale + fraction_scale / 2) / fraction_scale;
+    return 0;
+}
+
+/*
+ * The arguments shared by Start_Alarm, Start_Periodic_Alarm and
+ * Change_Alarm, starting at the '(' after the name:  "(id): Group(group) duration message".
+ */
+static int parse_alarm (const char **cursor, const char *end, alarm_command_t *command)
+{
+    const char *token;
+
+    if (parse_literal (cursor, end, "(") != 0
+        || parse_int (cursor, end, &command -> alarm_id) != 0
+        || parse_literal (cursor, end, "):") != 0) {
+        return -1;
+    }
+    parse_blanks (cursor, end);
+    if (parse_literal (cursor, end, "Group(") != 0
+        || parse_int (cursor, end, &command -> group_id) != 0
+        || parse_literal (cursor, end, ")") != 0) {
+        return -1;
+    }
+
+    parse_blanks (cursor, end);
+    token = *cursor;
+    while (*cursor < end && !parse_is_blank (**cursor)) {
+        (*cursor)++;
+    }
+    if (alarm_parse_duration (token, *cursor - token, &command -> duration) != 0) {
+        return -1;
+    }
+
+    // The message is the rest of the line
+    parse_blanks (cursor, end);
+    command -> message = *cursor;
+    while (*cursor < end && **cursor != '\n') {
+        (*cursor)++;
+    }
+    command -> message_length = *cursor - command -> message;
+    return command -> message_length > 0 ? 0 : -1;
+}
+
+/*
+ * The argument of Cancel_Alarm, Cancel_Group and List_Group,
+ * starting at the '(' after the name: "(number)", then nothing but
+ * blanks.
+ */
+static int parse_single (const char **cursor, const char *end, int *value)
+{
+    if (parse_literal (cursor, end, "(") != 0
+        || parse_int (cursor, end, value) != 0
+        || parse_literal (cursor, end, ")") != 0) {
+        return -1;
+    }
+    parse_blanks (cursor, end);
+    return *cursor == end ? 0 : -1;
+}
+
+int alarm_parse (const char *line, size_t length, alarm_command_t *command)
+{
+    const char *cursor = line, *end = line + length;
+    size_t index, name_length;
+
+    // The name is everything up to the '(', less trailing blanks
+    command -> name = cursor;
+    while (cursor < end && *cursor != '(' && *cursor != '\n') {
+        cursor++;
+    }
+    name_length = cursor - line;
+    while (name_length > 0 && parse_is_blank (line[name_length - 1])) {
+        name_length--;
+    }
+    command -> name_length = name_length;
+    if (command -> name_length == 0) {
+        command -> type = ALARM_COMMAND_NONE;
+        return 0;
+    }
+    if (command -> name_length > PARSE_NAME_MAX) {
+        command -> name_length = PARSE_NAME_MAX;
+    }
+
+    command -> type = ALARM_COMMAND_UNKNOWN;
+    for (index = 0; index < sizeof (parse_commands) / sizeof (parse_commands[0]); index++) {
+        if (strlen (parse_commands[index].name) == name_length
+            && memcmp (parse_commands[index].name, line, name_length) == 0) {
+            command -> type = parse_commands[index].type;
+            break;
+        }
+    }
+
+    switch (command -> type) {
+    case ALARM_COMMAND_START:
+    case ALARM_COMMAND_CHANGE:
+        return parse_alarm (&cursor, end, command);
+    case ALARM_COMMAND_PERIODIC:
+        if (parse_alarm (&cursor, end, command) != 0) {
+            return -1;
+        }
+        return command -> duration > 0 ? 0 : -1;
+    case ALARM_COMMAND_CANCEL:
+        return parse_single (&cursor, end, &command -> alarm_id);
+    case ALARM_COMMAND_CANCEL_GROUP:
+    case ALARM_COMMAND_LIST_GROUP:
+        return parse_single (&cursor, end, &command -> group_id);
+    case ALARM_COMMAND_LIST:
+    case ALARM_COMMAND_STATS:
+        parse_blanks (&cursor, end);
+        return cursor == end ? 0 : -1;
+    }
+    return 0;
+}
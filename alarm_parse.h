@@ -0,0 +1,76 @@
+/*
+ * alarm_parse.h
+ *
+ * Command parser. A command line is scanned once, left to right,
+ * in place: numbers are converted as they are read, and the message
+ * is returned as a pointer into the line and a length rather than
+ * copied out, so it can go straight to alarm_message_store.
+ *
+ * The grammar is the one the sscanf formats used to accept:
+ *
+ *      Start_Alarm(id): Group(group) duration message
+ *      Start_Periodic_Alarm(id): Group(group) period message
+ *      Change_Alarm(id): Group(group) duration message
+ *      Cancel_Alarm(id)
+ *      Cancel_Group(group)
+ *      List_Alarms
+ *      List_Group(group)
+ *      Stats
+ *
+ * where blanks may appear wherever the formats allowed them, the
+ * duration is as for alarm_parse_duration, and the message runs to
+ * the end of the line (or a newline) and must not be empty. A
+ * periodic alarm's period, in alarm_command_t.duration, must not be
+ * zero.
+ */
+#ifndef __alarm_parse_h
+#define __alarm_parse_h
+
+#include <stddef.h>
+#include "alarm_queue.h"
+
+/*
+ * Command types, in alarm_command_t.type.
+ */
+#define ALARM_COMMAND_NONE      0       /* nothing to do (blank line) */
+#define ALARM_COMMAND_UNKNOWN   1       /* name is not a command */
+#define ALARM_COMMAND_START     2
+#define ALARM_COMMAND_CHANGE    3
+#define ALARM_COMMAND_STATS     4
+#define ALARM_COMMAND_CANCEL    5       /* sets alarm_id */
+#define ALARM_COMMAND_CANCEL_GROUP 6    /* sets group_id */
+#define ALARM_COMMAND_PERIODIC  7
+#define ALARM_COMMAND_LIST      8
+#define ALARM_COMMAND_LIST_GROUP 9      /* sets group_id */
+
+/*
+ * A parsed command. "name" and "message" point into the line.
+ */
+typedef struct alarm_command_tag {
+    int                 type;
+    const char          *name;
+    size_t              name_length;
+    int                 alarm_id;
+    int                 group_id;
+    alarm_time_t        duration;       /* ns */
+    const char          *message;
+    size_t              message_length;
+} alarm_command_t;
+
+/*
+ * Parse the "length" bytes of "line". Returns 0 with "command"
+ * filled in, or -1 if the arguments don't fit the grammar of the
+ * command named; command->type then says which command that was
+ * (ALARM_COMMAND_UNKNOWN if none). The line is not modified.
+ */
+extern int alarm_parse (const char *line, size_t length, alarm_command_t *command);
+
+/*
+ * Parse an alarm duration: a number of seconds, which may have a
+ * fraction ("2", "0.25"), optionally followed by a unit of "s",
+ * "ms" or "us". Returns 0 and stores nanoseconds in "duration", or
+ * -1 if the text is not a non-negative duration.
+ */
+extern int alarm_parse_duration (const char *text, size_t length, alarm_time_t *duration);
+
+#endif
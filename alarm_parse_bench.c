@@ -0,0 +1,159 @@
+/*
+ * alarm_parse_bench.c
+ *
+ * Compare alarm_parse with the sscanf path it replaced, on "count"
+ * generated Start_Alarm and Change_Alarm lines with a mix of
+ * duration forms and message lengths. Each parser runs over every
+ * line "rounds" times; the results are checked against each other
+ * once before timing. Only parsing is measured -- nothing is
+ * scheduled.
+ *
+ * usage: alarm_parse_bench [count [rounds]]
+ */
+#include <time.h>
+#include "errors.h"
+#include "alarm_parse.h"
+
+#define LINE_MAX_LENGTH (ALARM_MESSAGE_MAX + 128)
+
+static double elapsed (struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start -> tv_sec)
+        + (end.tv_nsec - start -> tv_nsec) / 1e9;
+}
+
+/*
+ * The duration parser the command loop used with sscanf.
+ */
+static int scanf_duration (const char *text, alarm_time_t *duration)
+{
+    char *unit;
+    double value = strtod (text, &unit);
+    double scale;
+
+    if (unit == text || value < 0) {
+        return -1;
+    }
+    if (*unit == '\0' || strcmp (unit, "s") == 0) {
+        scale = ALARM_NSEC_PER_SEC;
+    } else if (strcmp (unit, "ms") == 0) {
+        scale = ALARM_NSEC_PER_MSEC;
+    } else if (strcmp (unit, "us") == 0) {
+        scale = 1000;
+    } else {
+        return -1;
+    }
+    *duration = (alarm_time_t) (value * scale + 0.5);
+    return 0;
+}
+
+/*
+ * The sscanf path, as the command loop had it: name, strcmp chain,
+ * then the command's own format, copying the message out.
+ */
+static int scanf_parse (const char *line, alarm_command_t *command, char *message)
+{
+    char name[16], seconds[32];
+
+    if (sscanf (line, "%15[^(\n]", name) != 1) {
+        command -> type = ALARM_COMMAND_NONE;
+        return 0;
+    }
+    if (strcmp (name, "Start_Alarm") == 0) {
+        command -> type = ALARM_COMMAND_START;
+    } else if (strcmp (name, "Change_Alarm") == 0) {
+        command -> type = ALARM_COMMAND_CHANGE;
+    } else {
+        command -> type = ALARM_COMMAND_UNKNOWN;
+        return 0;
+    }
+    if (sscanf (line, "%*[^(](%d): Group(%d) %31s %[^\n]", &command -> alarm_id,
+            &command -> group_id, seconds, message) != 4
+        || scanf_duration (seconds, &command -> duration) != 0) {
+        return -1;
+    }
+    command -> message = message;
+    command -> message_length = strlen (message);
+    return 0;
+}
+
+int main (int argc, char *argv[])
+{
+    static const char *units[] = { "", "s", "ms", "us" };
+    int count = argc > 1 ? atoi (argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi (argv[2]) : 10;
+    char (*lines)[LINE_MAX_LENGTH];
+    size_t *lengths;
+    char message[LINE_MAX_LENGTH];
+    alarm_command_t scanned, parsed;
+    struct timespec start;
+    double scanf_secs, parse_secs;
+    long long checksum = 0;
+    int index, round;
+
+    if (count <= 0 || rounds <= 0) {
+        fprintf (stderr, "usage: %s [count [rounds]]\n", argv[0]);
+        exit (1);
+    }
+    lines = malloc (count * sizeof (lines[0]));
+    lengths = malloc (count * sizeof (size_t));
+    if (lines == NULL || lengths == NULL) {
+        errno_abort ("Allocate lines");
+    }
+
+    srand (1);
+    for (index = 0; index < count; index++) {
+        int text = 1 + rand () % 60;
+
+        lengths[index] = snprintf (lines[index], LINE_MAX_LENGTH,
+            "%s(%d): Group(%d) %d%s %.*s\n",
+            rand () % 4 == 0 ? "Change_Alarm" : "Start_Alarm",
+            rand (), rand () % 100, 1 + rand () % 1000, units[rand () % 4],
+            text, "The quick brown fox jumps over the lazy dog, then naps again.");
+    }
+
+    // Both parsers must agree before their speed means anything
+    for (index = 0; index < count; index++) {
+        if (scanf_parse (lines[index], &scanned, message) != 0
+            || alarm_parse (lines[index], lengths[index], &parsed) != 0
+            || scanned.type != parsed.type || scanned.alarm_id != parsed.alarm_id
+            || scanned.group_id != parsed.group_id || scanned.duration != parsed.duration
+            || scanned.message_length != parsed.message_length
+            || memcmp (scanned.message, parsed.message, parsed.message_length) != 0) {
+            fprintf (stderr, "Parsers disagree on: %s", lines[index]);
+            exit (1);
+        }
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (round = 0; round < rounds; round++) {
+        for (index = 0; index < count; index++) {
+            scanf_parse (lines[index], &scanned, message);
+            checksum += scanned.alarm_id;
+        }
+    }
+    scanf_secs = elapsed (&start);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (round = 0; round < rounds; round++) {
+        for (index = 0; index < count; index++) {
+            alarm_parse (lines[index], lengths[index], &parsed);
+            checksum -= parsed.alarm_id;
+        }
+    }
+    parse_secs = elapsed (&start);
+
+    if (checksum != 0) {
+        fprintf (stderr, "Checksum mismatch\n");
+        exit (1);
+    }
+    printf ("%d commands x %d rounds (commands/sec)\n", count, rounds);
+    printf ("%-12s %12.0f\n", "sscanf", (double) count * rounds / scanf_secs);
+    printf ("%-12s %12.0f\n", "alarm_parse", (double) count * rounds / parse_secs);
+    free (lines);
+    free (lengths);
+    return 0;
+}
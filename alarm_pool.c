@@ -0,0 +1,144 @@
+/*
+ * alarm_pool.c
+ *
+ * Each thread caches free alarms on a private list linked through
+ * alarm_t.link. An empty cache refills with one batch of
+ * POOL_BATCH alarms from the depot, or from a fresh slab if the
+ * depot is empty; a cache that grows past two batches hands one
+ * batch back. The depot keeps whole batches, chained through
+ * alarm_t.prev of each batch's first alarm, so moving a batch in
+ * or out is O(1) under pool_mutex.
+ */
+#include <pthread.h>
+#include "errors.h"
+#include "alarm_pool.h"
+#include "alarm_stats.h"
+
+#ifdef NO_ALARM_POOL
+
+alarm_t *alarm_alloc (void)
+{
+    alarm_t *alarm = (alarm_t*)aligned_alloc (_Alignof (alarm_t), sizeof (alarm_t));
+
+    if (alarm == NULL) {
+        errno_abort ("Allocate alarm");
+    }
+    return alarm;
+}
+
+void alarm_free (alarm_t *alarm)
+{
+    free (alarm);
+}
+
+#else
+
+#define POOL_BATCH      64      /* alarms moved to or from the depot */
+#define POOL_SLAB       1024    /* alarms carved per slab */
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static alarm_t *pool_depot = NULL;      /* full batches */
+
+static __thread alarm_t *pool_cache = NULL;
+static __thread int pool_cached = 0;
+
+/*
+ * Refill an empty thread cache with one batch. Slabs are never
+ * returned to malloc; the pool only grows to the peak number of
+ * live alarms.
+ */
+static void alarm_pool_refill (void)
+{
+    alarm_t *batch, *slab;
+    int status, index;
+    STATS_TIMER (timer);
+
+    STATS_START (timer);
+    status = pthread_mutex_lock (&pool_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    STATS_WAIT (ALARM_SITE_POOL, timer);
+    batch = pool_depot;
+    if (batch != NULL) {
+        pool_depot = batch -> prev;
+    }
+    STATS_HOLD (ALARM_SITE_POOL, timer);
+    status = pthread_mutex_unlock (&pool_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+
+    if (batch != NULL) {
+        pool_cache = batch;
+        pool_cached = POOL_BATCH;
+        return;
+    }
+
+    // Depot is empty: carve a new slab, a cache line per alarm
+    slab = (alarm_t*)aligned_alloc (_Alignof (alarm_t), POOL_SLAB * sizeof (alarm_t));
+    if (slab == NULL) {
+        errno_abort ("Allocate alarm slab");
+    }
+    for (index = 0; index < POOL_SLAB - 1; index++) {
+        slab[index].link = &slab[index + 1];
+    }
+    slab[POOL_SLAB - 1].link = NULL;
+    pool_cache = slab;
+    pool_cached = POOL_SLAB;
+}
+
+/*
+ * Move one batch from an overfull thread cache to the depot.
+ */
+static void alarm_pool_flush (void)
+{
+    alarm_t *batch = pool_cache, *last = batch;
+    int status, index;
+    STATS_TIMER (timer);
+
+    for (index = 1; index < POOL_BATCH; index++) {
+        last = last -> link;
+    }
+    pool_cache = last -> link;
+    pool_cached -= POOL_BATCH;
+    last -> link = NULL;
+
+    STATS_START (timer);
+    status = pthread_mutex_lock (&pool_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    STATS_WAIT (ALARM_SITE_POOL, timer);
+    batch -> prev = pool_depot;
+    pool_depot = batch;
+    STATS_HOLD (ALARM_SITE_POOL, timer);
+    status = pthread_mutex_unlock (&pool_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+alarm_t *alarm_alloc (void)
+{
+    alarm_t *alarm;
+
+    if (pool_cache == NULL) {
+        alarm_pool_refill ();
+    }
+    alarm = pool_cache;
+    pool_cache = alarm -> link;
+    pool_cached--;
+    return alarm;
+}
+
+void alarm_free (alarm_t *alarm)
+{
+    alarm -> link = pool_cache;
+    pool_cache = alarm;
+    if (++pool_cached >= 2 * POOL_BATCH) {
+        alarm_pool_flush ();
+    }
+}
+
+#endif
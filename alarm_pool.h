@@ -0,0 +1,29 @@
+/*
+ * alarm_pool.h
+ *
+ * Fixed-size allocator for alarm_t. Alarms are carved from slabs
+ * and recycled through per-thread free lists, which exchange whole
+ * batches with a shared depot, so the common allocate and free
+ * take no lock and never reach malloc. Alarms are typically
+ * allocated by one thread (main) and freed by another (the alarm
+ * thread); the depot is where they meet.
+ *
+ * When compiled -DNO_ALARM_POOL, alarm_alloc and alarm_free are
+ * plain malloc and free, for comparison.
+ */
+#ifndef __alarm_pool_h
+#define __alarm_pool_h
+
+#include "alarm_queue.h"
+
+/*
+ * Return an uninitialized alarm. Aborts if memory is exhausted.
+ */
+extern alarm_t *alarm_alloc (void);
+
+/*
+ * Return an alarm (from any thread) to the pool.
+ */
+extern void alarm_free (alarm_t *alarm);
+
+#endif
@@ -0,0 +1,660 @@
+/*
+ * alarm_queue.c
+ *
+ * Timer queue backends for the alarm thread. See alarm_queue.h
+ * for the interface; everything here assumes the caller holds
+ * whatever lock protects the queue.
+ */
+#include <time.h>
+#include "errors.h"
+#include "alarm_queue.h"
+
+#ifdef ALARM_BACKEND_LIST
+
+/*
+ * List backend: alarms are kept on a doubly-linked list sorted
+ * by expiration time. Inserting walks the list; removal and
+ * peeking at the earliest alarm are O(1).
+ */
+static void list_insert (alarm_queue_t *queue, alarm_t *alarm)
+{
+    alarm_t **last = &queue -> list, *next = *last, *prev = NULL;
+
+    // Traverse the list to find the correct insertion point
+    while (next != NULL && next -> time <= alarm -> time) {
+        prev = next;
+        last = &next -> link;
+        next = next -> link;
+    }
+    alarm -> link = next;
+    alarm -> prev = prev;
+    if (next != NULL) {
+        next -> prev = alarm;
+    }
+    *last = alarm;
+    queue -> count++;
+}
+
+/*
+ * Sort a batch (by merge sort, keeping equal deadlines in batch
+ * order) and merge it into the list in a single walk, which costs
+ * O(n + k log k) rather than O(nk) for inserting one at a time.
+ */
+static void list_insert_batch (alarm_queue_t *queue, alarm_t *batch, int count)
+{
+    alarm_t *sorted = NULL, **last, *left, *right, *prev = NULL;
+    int width, index;
+
+    // Bottom-up merge sort on the singly-linked batch
+    for (width = 1; width < count; width *= 2) {
+        alarm_t *rest = batch;
+
+        last = &sorted;
+        while (rest != NULL) {
+            int left_size = 0, right_size = 0;
+
+            left = rest;
+            for (index = 0; index < width && rest != NULL; index++) {
+                rest = rest -> link;
+                left_size++;
+            }
+            right = rest;
+            for (index = 0; index < width && rest != NULL; index++) {
+                rest = rest -> link;
+                right_size++;
+            }
+            while (left_size > 0 || right_size > 0) {
+                if (right_size == 0 || (left_size > 0 && left -> time <= right -> time)) {
+                    *last = left;
+                    left = left -> link;
+                    left_size--;
+                } else {
+                    *last = right;
+                    right = right -> link;
+                    right_size--;
+                }
+                last = &(*last) -> link;
+            }
+        }
+        *last = NULL;
+        batch = sorted;
+    }
+
+    // Merge, fixing up the back links as we go
+    last = &queue -> list;
+    left = queue -> list;
+    while (left != NULL || batch != NULL) {
+        if (batch == NULL || (left != NULL && left -> time <= batch -> time)) {
+            *last = left;
+            left = left -> link;
+        } else {
+            *last = batch;
+            batch = batch -> link;
+        }
+        (*last) -> prev = prev;
+        prev = *last;
+        last = &prev -> link;
+    }
+    *last = NULL;
+    queue -> count += count;
+}
+
+static void list_remove (alarm_queue_t *queue, alarm_t *alarm)
+{
+    if (alarm -> prev != NULL) {
+        alarm -> prev -> link = alarm -> link;
+    } else {
+        queue -> list = alarm -> link;
+    }
+    if (alarm -> link != NULL) {
+        alarm -> link -> prev = alarm -> prev;
+    }
+    alarm -> link = alarm -> prev = NULL;
+    queue -> count--;
+}
+
+static void list_update (alarm_queue_t *queue, alarm_t *alarm, alarm_time_t time)
+{
+    list_remove (queue, alarm);
+    alarm -> time = time;
+    list_insert (queue, alarm);
+}
+
+static alarm_time_t list_next_time (alarm_queue_t *queue)
+{
+    return queue -> list != NULL ? queue -> list -> time : 0;
+}
+
+static alarm_t *list_expire (alarm_queue_t *queue, alarm_time_t now)
+{
+    alarm_t *alarm = queue -> list;
+
+    if (alarm == NULL || alarm -> time > now) {
+        return NULL;
+    }
+    list_remove (queue, alarm);
+    return alarm;
+}
+
+static void list_foreach (alarm_queue_t *queue, alarm_visit_t visit, void *arg)
+{
+    alarm_t *alarm;
+
+    for (alarm = queue -> list; alarm != NULL; alarm = alarm -> link) {
+        visit (alarm, arg);
+    }
+}
+
+#endif
+
+#ifdef ALARM_BACKEND_HEAP
+
+/*
+ * Heap backend: a binary min-heap ordered by expiration time, so
+ * the earliest alarm is always heap[0]. The heap array holds
+ * (deadline, alarm) key records, so sifting never touches the
+ * alarms themselves except to record each one's slot in
+ * queue_index, which lets it be located without a search.
+ */
+static void heap_set (alarm_queue_t *queue, int index, alarm_heap_entry_t entry)
+{
+    queue -> heap[index] = entry;
+    entry.alarm -> queue_index = index;
+}
+
+/*
+ * Move the entry at "index" towards the root until its parent
+ * expires no later than it does.
+ */
+static void heap_sift_up (alarm_queue_t *queue, int index)
+{
+    alarm_heap_entry_t entry = queue -> heap[index];
+
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+
+        if (queue -> heap[parent].time <= entry.time) {
+            break;
+        }
+        heap_set (queue, index, queue -> heap[parent]);
+        index = parent;
+    }
+    heap_set (queue, index, entry);
+}
+
+/*
+ * Move the entry at "index" towards the leaves until both of its
+ * children expire no earlier than it does.
+ */
+static void heap_sift_down (alarm_queue_t *queue, int index)
+{
+    alarm_heap_entry_t entry = queue -> heap[index];
+    int size = queue -> count;
+
+    while (1) {
+        int child = 2 * index + 1;
+
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size
+            && queue -> heap[child + 1].time < queue -> heap[child].time) {
+            child++;
+        }
+        if (entry.time <= queue -> heap[child].time) {
+            break;
+        }
+        heap_set (queue, index, queue -> heap[child]);
+        index = child;
+    }
+    heap_set (queue, index, entry);
+}
+
+/*
+ * Grow the heap array geometrically until "count" entries fit.
+ */
+static void heap_reserve (alarm_queue_t *queue, int count)
+{
+    int capacity = queue -> capacity ? queue -> capacity : 64;
+    alarm_heap_entry_t *heap;
+
+    if (count <= queue -> capacity) {
+        return;
+    }
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    heap = realloc (queue -> heap, capacity * sizeof (alarm_heap_entry_t));
+    if (heap == NULL) {
+        errno_abort ("Grow alarm heap");
+    }
+    queue -> heap = heap;
+    queue -> capacity = capacity;
+}
+
+static void heap_insert (alarm_queue_t *queue, alarm_t *alarm)
+{
+    alarm_heap_entry_t entry;
+
+    heap_reserve (queue, queue -> count + 1);
+
+    // Append at the first free leaf and restore heap order
+    entry.time = alarm -> time;
+    entry.alarm = alarm;
+    heap_set (queue, queue -> count, entry);
+    queue -> count++;
+    heap_sift_up (queue, alarm -> queue_index);
+}
+
+/*
+ * Append the whole batch, then restore heap order. If the batch is
+ * large next to the heap, rebuilding it bottom-up (Floyd) in O(n + k)
+ * beats k sifts up; otherwise sift just the new leaves.
+ */
+static void heap_insert_batch (alarm_queue_t *queue, alarm_t *batch, int count)
+{
+    alarm_heap_entry_t entry;
+    int first = queue -> count, index;
+
+    heap_reserve (queue, queue -> count + count);
+    for (; batch != NULL; batch = batch -> link) {
+        entry.time = batch -> time;
+        entry.alarm = batch;
+        heap_set (queue, queue -> count, entry);
+        queue -> count++;
+    }
+
+    if (count > first / 4) {
+        for (index = queue -> count / 2 - 1; index >= 0; index--) {
+            heap_sift_down (queue, index);
+        }
+    } else {
+        for (index = first; index < queue -> count; index++) {
+            heap_sift_up (queue, index);
+        }
+    }
+}
+
+static void heap_remove (alarm_queue_t *queue, alarm_t *alarm)
+{
+    int index = alarm -> queue_index;
+    int last = queue -> count - 1;
+
+    // Fill the hole with the last leaf, which may need to move either way
+    queue -> count--;
+    if (index != last) {
+        alarm_t *moved = queue -> heap[last].alarm;
+
+        heap_set (queue, index, queue -> heap[last]);
+        heap_sift_up (queue, index);
+        heap_sift_down (queue, moved -> queue_index);
+    }
+    alarm -> queue_index = -1;
+}
+
+/*
+ * Only one of the two sifts can move the alarm, depending on
+ * whether its key went down or up.
+ */
+static void heap_update (alarm_queue_t *queue, alarm_t *alarm, alarm_time_t time)
+{
+    alarm -> time = time;
+    queue -> heap[alarm -> queue_index].time = time;
+    heap_sift_up (queue, alarm -> queue_index);
+    heap_sift_down (queue, alarm -> queue_index);
+}
+
+static alarm_time_t heap_next_time (alarm_queue_t *queue)
+{
+    return queue -> count > 0 ? queue -> heap[0].time : 0;
+}
+
+static alarm_t *heap_expire (alarm_queue_t *queue, alarm_time_t now)
+{
+    alarm_t *alarm;
+
+    if (queue -> count == 0 || queue -> heap[0].time > now) {
+        return NULL;
+    }
+    alarm = queue -> heap[0].alarm;
+    heap_remove (queue, alarm);
+    return alarm;
+}
+
+static void heap_foreach (alarm_queue_t *queue, alarm_visit_t visit, void *arg)
+{
+    int index;
+
+    for (index = 0; index < queue -> count; index++) {
+        visit (queue -> heap[index].alarm, arg);
+    }
+}
+
+#endif
+
+#ifdef ALARM_BACKEND_WHEEL
+
+/*
+ * Wheel backend: a hierarchical timing wheel. Level 0 has one
+ * bucket per tick; each bucket at level l covers 64^l ticks. An
+ * alarm lives at the lowest level whose span still shares every
+ * higher digit with the current tick, so all alarms on a level are
+ * later than all alarms below it. When the current tick reaches
+ * the start of a populated coarse bucket, that bucket is cascaded:
+ * its alarms are redistributed into finer levels. Alarms that are
+ * due sit in the extra ALARM_WHEEL_DUE bucket until expired, and
+ * alarms beyond the top level wait in ALARM_WHEEL_FAR until the
+ * current tick enters their top-level span.
+ *
+ * A tick is one millisecond. Deadlines are rounded up to the next
+ * tick so that an alarm never fires early, while the clock is
+ * rounded down when expiring. Alarms due in the same tick expire in
+ * no particular order.
+ */
+#define WHEEL_MASK      (ALARM_WHEEL_SIZE - 1)
+#define WHEEL_TICK      ALARM_WHEEL_TICK
+#define wheel_tick(t)   ((unsigned long long) (((t) + WHEEL_TICK - 1) / WHEEL_TICK))
+#define wheel_time(k)   ((alarm_time_t) (k) * WHEEL_TICK)
+
+/*
+ * Pick the bucket for a tick relative to the wheel's current tick.
+ */
+static int wheel_bucket (alarm_queue_t *queue, unsigned long long tick)
+{
+    unsigned long long now = queue -> wheel_now;
+    int level;
+
+    if (tick <= now) {
+        return ALARM_WHEEL_DUE;
+    }
+    for (level = 0; level < ALARM_WHEEL_LEVELS; level++) {
+        int shift = ALARM_WHEEL_BITS * (level + 1);
+
+        if ((tick >> shift) == (now >> shift)) {
+            return level * ALARM_WHEEL_SIZE
+                + (int) ((tick >> (ALARM_WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+    }
+    return ALARM_WHEEL_FAR;
+}
+
+static void wheel_link (alarm_queue_t *queue, alarm_t *alarm)
+{
+    int bucket = wheel_bucket (queue, wheel_tick (alarm -> time));
+
+    alarm -> queue_index = bucket;
+    alarm -> prev = NULL;
+    alarm -> link = queue -> wheel[bucket];
+    if (alarm -> link != NULL) {
+        alarm -> link -> prev = alarm;
+    }
+    queue -> wheel[bucket] = alarm;
+    if (bucket < ALARM_WHEEL_DUE) {
+        queue -> wheel_map[bucket / ALARM_WHEEL_SIZE] |=
+            1ULL << (bucket & WHEEL_MASK);
+    }
+}
+
+static void wheel_insert (alarm_queue_t *queue, alarm_t *alarm)
+{
+    wheel_link (queue, alarm);
+    queue -> count++;
+}
+
+/*
+ * Insertion is O(1) already, so a batch is just a loop.
+ */
+static void wheel_insert_batch (alarm_queue_t *queue, alarm_t *batch, int count)
+{
+    alarm_t *next;
+
+    for (; batch != NULL; batch = next) {
+        next = batch -> link;
+        wheel_insert (queue, batch);
+    }
+}
+
+static void wheel_remove (alarm_queue_t *queue, alarm_t *alarm)
+{
+    int bucket = alarm -> queue_index;
+
+    if (alarm -> prev != NULL) {
+        alarm -> prev -> link = alarm -> link;
+    } else {
+        queue -> wheel[bucket] = alarm -> link;
+    }
+    if (alarm -> link != NULL) {
+        alarm -> link -> prev = alarm -> prev;
+    }
+    if (queue -> wheel[bucket] == NULL && bucket < ALARM_WHEEL_DUE) {
+        queue -> wheel_map[bucket / ALARM_WHEEL_SIZE] &=
+            ~(1ULL << (bucket & WHEEL_MASK));
+    }
+    alarm -> link = alarm -> prev = NULL;
+    alarm -> queue_index = -1;
+    queue -> count--;
+}
+
+static void wheel_update (alarm_queue_t *queue, alarm_t *alarm, alarm_time_t time)
+{
+    wheel_remove (queue, alarm);
+    alarm -> time = time;
+    wheel_insert (queue, alarm);
+}
+
+/*
+ * Find the next tick at which the wheel has work to do: the first
+ * populated level-0 bucket at or after the current tick, or else
+ * the start of the first populated coarse bucket, or else the end
+ * of the top level's span if anything is parked beyond it. Lower
+ * levels always come first, so the search stops at the first hit.
+ * Returns the bucket, or -1 if the wheel is empty.
+ */
+static int wheel_next_event (alarm_queue_t *queue, unsigned long long *tick)
+{
+    unsigned long long now = queue -> wheel_now;
+    int level;
+
+    for (level = 0; level < ALARM_WHEEL_LEVELS; level++) {
+        int shift = ALARM_WHEEL_BITS * level;
+        int digit = (int) ((now >> shift) & WHEEL_MASK);
+        unsigned long long map = queue -> wheel_map[level];
+        int slot;
+
+        if (level == 0) {
+            map &= ~0ULL << digit;
+        } else {
+            map &= digit == WHEEL_MASK ? 0 : ~0ULL << (digit + 1);
+        }
+        if (map == 0) {
+            continue;
+        }
+        slot = __builtin_ctzll (map);
+        *tick = ((now >> (shift + ALARM_WHEEL_BITS)) << (shift + ALARM_WHEEL_BITS))
+            | ((unsigned long long) slot << shift);
+        return level * ALARM_WHEEL_SIZE + slot;
+    }
+    if (queue -> wheel[ALARM_WHEEL_FAR] != NULL) {
+        int shift = ALARM_WHEEL_BITS * ALARM_WHEEL_LEVELS;
+
+        *tick = ((now >> shift) + 1) << shift;
+        return ALARM_WHEEL_FAR;
+    }
+    return -1;
+}
+
+static alarm_time_t wheel_next_time (alarm_queue_t *queue)
+{
+    unsigned long long tick;
+
+    if (queue -> count == 0) {
+        return 0;
+    }
+    if (queue -> wheel[ALARM_WHEEL_DUE] != NULL
+        || wheel_next_event (queue, &tick) < 0) {
+        return wheel_time (queue -> wheel_now);
+    }
+    return wheel_time (tick);
+}
+
+static alarm_t *wheel_expire (alarm_queue_t *queue, alarm_time_t now)
+{
+    unsigned long long target = (unsigned long long) (now / WHEEL_TICK), tick;
+    alarm_t *alarm, *next;
+    int bucket;
+
+    /*
+     * Advance the wheel one event at a time until something is
+     * due or the next event lies beyond "now". Each event either
+     * moves a level-0 bucket to the due list or cascades a coarse
+     * bucket one or more levels down.
+     */
+    while (queue -> wheel[ALARM_WHEEL_DUE] == NULL) {
+        bucket = wheel_next_event (queue, &tick);
+        if (bucket < 0 || tick > target) {
+            return NULL;
+        }
+        queue -> wheel_now = tick;
+        alarm = queue -> wheel[bucket];
+        queue -> wheel[bucket] = NULL;
+        if (bucket < ALARM_WHEEL_DUE) {
+            queue -> wheel_map[bucket / ALARM_WHEEL_SIZE] &=
+                ~(1ULL << (bucket & WHEEL_MASK));
+        }
+        for (; alarm != NULL; alarm = next) {
+            next = alarm -> link;
+            wheel_link (queue, alarm);
+        }
+    }
+    alarm = queue -> wheel[ALARM_WHEEL_DUE];
+    wheel_remove (queue, alarm);
+    return alarm;
+}
+
+static void wheel_foreach (alarm_queue_t *queue, alarm_visit_t visit, void *arg)
+{
+    alarm_t *alarm;
+    int bucket;
+
+    for (bucket = 0; bucket <= ALARM_WHEEL_FAR; bucket++) {
+        for (alarm = queue -> wheel[bucket]; alarm != NULL; alarm = alarm -> link) {
+            visit (alarm, arg);
+        }
+    }
+}
+
+#endif
+
+alarm_time_t alarm_now (void)
+{
+    struct timespec now;
+
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * ALARM_NSEC_PER_SEC + now.tv_nsec;
+}
+
+void alarm_timespec (alarm_time_t time, struct timespec *ts)
+{
+    ts -> tv_sec = time / ALARM_NSEC_PER_SEC;
+    ts -> tv_nsec = time % ALARM_NSEC_PER_SEC;
+}
+
+static const alarm_queue_ops_t alarm_queue_backends[] = {
+#ifdef ALARM_BACKEND_LIST
+    { "list", list_insert, list_insert_batch, list_remove, list_update,
+        list_next_time, list_expire, list_foreach },
+#endif
+#ifdef ALARM_BACKEND_HEAP
+    { "heap", heap_insert, heap_insert_batch, heap_remove, heap_update,
+        heap_next_time, heap_expire, heap_foreach },
+#endif
+#ifdef ALARM_BACKEND_WHEEL
+    { "wheel", wheel_insert, wheel_insert_batch, wheel_remove, wheel_update,
+        wheel_next_time, wheel_expire, wheel_foreach },
+#endif
+};
+
+/*
+ * The backend routine "op" for a queue: the queue's own when every
+ * backend is built in, otherwise the only one there is.
+ */
+#if defined (ALARM_BACKEND_ALL)
+# define QUEUE_OP(queue, op)    ((queue) -> ops -> op)
+#elif defined (ALARM_BACKEND_LIST)
+# define QUEUE_OP(queue, op)    list_##op
+#elif defined (ALARM_BACKEND_HEAP)
+# define QUEUE_OP(queue, op)    heap_##op
+#else
+# define QUEUE_OP(queue, op)    wheel_##op
+#endif
+
+int alarm_queue_init (alarm_queue_t *queue, const char *backend)
+{
+    int index;
+
+    memset (queue, 0, sizeof (*queue));
+    for (index = 0; index < sizeof (alarm_queue_backends) / sizeof (alarm_queue_backends[0]); index++) {
+        if (strcmp (backend, alarm_queue_backends[index].name) == 0) {
+            queue -> ops = &alarm_queue_backends[index];
+#ifdef ALARM_BACKEND_WHEEL
+            queue -> wheel_now = wheel_tick (alarm_now ());
+#endif
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void alarm_queue_insert (alarm_queue_t *queue, alarm_t *alarm)
+{
+    QUEUE_OP (queue, insert) (queue, alarm);
+}
+
+void alarm_queue_insert_batch (alarm_queue_t *queue, alarm_t *batch, int count)
+{
+    if (batch != NULL) {
+        QUEUE_OP (queue, insert_batch) (queue, batch, count);
+    }
+}
+
+void alarm_queue_remove (alarm_queue_t *queue, alarm_t *alarm)
+{
+    QUEUE_OP (queue, remove) (queue, alarm);
+}
+
+void alarm_queue_update (alarm_queue_t *queue, alarm_t *alarm, alarm_time_t time)
+{
+    QUEUE_OP (queue, update) (queue, alarm, time);
+}
+
+alarm_time_t alarm_queue_next_time (alarm_queue_t *queue)
+{
+    return QUEUE_OP (queue, next_time) (queue);
+}
+
+alarm_t *alarm_queue_expire (alarm_queue_t *queue, alarm_time_t now)
+{
+    return QUEUE_OP (queue, expire) (queue, now);
+}
+
+alarm_t *alarm_queue_expire_batch (alarm_queue_t *queue, alarm_time_t now)
+{
+    alarm_t *batch = NULL, **last = &batch, *alarm;
+
+    /*
+     * Each expire is O(1) for the list and O(1) amortized for the
+     * wheel, so draining k alarms costs O(k) there (O(k log n) for
+     * the heap).
+     */
+    while ((alarm = QUEUE_OP (queue, expire) (queue, now)) != NULL) {
+        *last = alarm;
+        last = &alarm -> link;
+    }
+    *last = NULL;
+    return batch;
+}
+
+void alarm_queue_foreach (alarm_queue_t *queue, alarm_visit_t visit, void *arg)
+{
+    QUEUE_OP (queue, foreach) (queue, visit, arg);
+}
@@ -0,0 +1,206 @@
+/*
+ * alarm_queue.h
+ *
+ * Timer queue used by the alarm thread. A queue holds pending
+ * alarms ordered by expiration time and is implemented by one of
+ * several interchangeable backends, chosen when the queue is
+ * initialized:
+ *
+ *      list    sorted doubly-linked list (O(n) insert)
+ *      heap    binary min-heap (O(log n) insert, O(1) peek)
+ *      wheel   hierarchical timing wheel (O(1) insert and
+ *              remove, amortized O(1) expiry)
+ *
+ * Built with one of -DALARM_BACKEND_LIST, -DALARM_BACKEND_HEAP or
+ * -DALARM_BACKEND_WHEEL, the queue has that backend alone, and the
+ * alarm_queue_ routines call it directly rather than through the
+ * queue's ops table, so the compiler can inline it into them.
+ *
+ * None of the routines lock anything; callers are expected to
+ * serialize access (new_alarm_cond.c holds alarm_mutex).
+ */
+#ifndef __alarm_queue_h
+#define __alarm_queue_h
+
+#include <time.h>
+#include "alarm_message.h"
+
+/*
+ * Alarm deadlines are nanosecond counts on CLOCK_MONOTONIC, which
+ * neither jumps with the wall clock nor rounds to whole seconds.
+ */
+typedef long long alarm_time_t;
+
+#define ALARM_NSEC_PER_SEC      1000000000LL
+#define ALARM_NSEC_PER_MSEC     1000000LL
+
+/*
+ * Current time on the alarm clock, and the same time as the
+ * absolute timespec pthread_cond_timedwait expects (for a
+ * condition variable whose clock is CLOCK_MONOTONIC).
+ */
+extern alarm_time_t alarm_now (void);
+extern void alarm_timespec (alarm_time_t time, struct timespec *ts);
+
+/*
+ * The "alarm" structure contains the absolute deadline for each
+ * alarm, so that they can be sorted. It holds only what the
+ * scheduler touches -- the message text lives in the message arena
+ * (alarm_message.h) -- and is aligned so that each alarm occupies
+ * a single cache line. The link fields and queue_index are owned by
+ * whichever queue backend the alarm is currently on; hash_link
+ * belongs to the alarm_id index (alarm_index.h) and group_index to
+ * the group index (alarm_group.h). To keep to one line, request,
+ * client and periodic share a word; descriptors stay far below
+ * 2^22.
+ */
+typedef struct alarm_tag {
+    struct alarm_tag    *link;          /* list/wheel chain */
+    struct alarm_tag    *prev;
+    struct alarm_tag    *hash_link;     /* alarm_id index chain */
+    alarm_time_t        time;           /* deadline, ns */
+    int                 queue_index;    /* heap slot or wheel bucket */
+    int                 alarm_id;
+    int                 group_id;
+    alarm_message_t     message;        /* handle into the arena */
+    alarm_time_t        duration;       /* requested delay, ns */
+    int                 request : 8;    /* see alarm_sched.h */
+    int                 client : 23;    /* output descriptor for replies */
+    unsigned int        periodic : 1;   /* re-armed every duration */
+    int                 group_index;    /* slot in its group's heap */
+} __attribute__ ((aligned (64))) alarm_t;
+
+/*
+ * The heap orders compact key records rather than alarms, so sifting
+ * compares deadlines that sit side by side in the heap array and
+ * only follows the pointer to update an alarm's queue_index.
+ */
+typedef struct alarm_heap_entry_tag {
+    alarm_time_t        time;
+    alarm_t             *alarm;
+} alarm_heap_entry_t;
+
+typedef void (*alarm_visit_t) (alarm_t *alarm, void *arg);
+
+/*
+ * Timing wheel geometry: ALARM_WHEEL_LEVELS levels of 64 buckets
+ * of ALARM_WHEEL_TICK nanoseconds at the finest level,
+ * each level 64 times coarser than the one below it. Two extra
+ * buckets at the end hold alarms that are already due and alarms
+ * beyond the span of the top level.
+ */
+#define ALARM_WHEEL_BITS        6
+#define ALARM_WHEEL_SIZE        (1 << ALARM_WHEEL_BITS)
+#define ALARM_WHEEL_LEVELS      6
+#define ALARM_WHEEL_DUE         (ALARM_WHEEL_LEVELS * ALARM_WHEEL_SIZE)
+#define ALARM_WHEEL_FAR         (ALARM_WHEEL_DUE + 1)
+#define ALARM_WHEEL_TICK        ALARM_NSEC_PER_MSEC
+
+/*
+ * The backend a program uses unless told otherwise: the one built
+ * in, or the heap when all of them are (when ALARM_BACKEND_ALL is
+ * defined, along with each of the others).
+ */
+#if defined (ALARM_BACKEND_LIST) + defined (ALARM_BACKEND_HEAP) + defined (ALARM_BACKEND_WHEEL) > 1
+# error "Build in at most one of ALARM_BACKEND_LIST, _HEAP and _WHEEL"
+#elif defined (ALARM_BACKEND_LIST)
+# define ALARM_QUEUE_DEFAULT    "list"
+#elif defined (ALARM_BACKEND_HEAP)
+# define ALARM_QUEUE_DEFAULT    "heap"
+#elif defined (ALARM_BACKEND_WHEEL)
+# define ALARM_QUEUE_DEFAULT    "wheel"
+#else
+# define ALARM_QUEUE_DEFAULT    "heap"
+# define ALARM_BACKEND_ALL
+# define ALARM_BACKEND_LIST
+# define ALARM_BACKEND_HEAP
+# define ALARM_BACKEND_WHEEL
+#endif
+
+typedef struct alarm_queue_tag alarm_queue_t;
+
+typedef struct alarm_queue_ops_tag {
+    const char  *name;
+    void        (*insert) (alarm_queue_t *queue, alarm_t *alarm);
+    void        (*insert_batch) (alarm_queue_t *queue, alarm_t *batch, int count);
+    void        (*remove) (alarm_queue_t *queue, alarm_t *alarm);
+    void        (*update) (alarm_queue_t *queue, alarm_t *alarm, alarm_time_t time);
+    alarm_time_t (*next_time) (alarm_queue_t *queue);
+    alarm_t     *(*expire) (alarm_queue_t *queue, alarm_time_t now);
+    void        (*foreach) (alarm_queue_t *queue, alarm_visit_t visit, void *arg);
+} alarm_queue_ops_t;
+
+struct alarm_queue_tag {
+    const alarm_queue_ops_t *ops;
+    int                 count;          /* alarms on the queue */
+
+    /* list backend */
+    alarm_t             *list;
+
+    /* heap backend */
+    alarm_heap_entry_t  *heap;
+    int                 capacity;
+
+    /* wheel backend */
+    unsigned long long  wheel_now;      /* current tick */
+    unsigned long long  wheel_map[ALARM_WHEEL_LEVELS];
+    alarm_t             *wheel[ALARM_WHEEL_FAR + 1];
+};
+
+/*
+ * Initialize "queue" with the named backend ("list", "heap" or
+ * "wheel"). Returns 0 on success, or -1 if the name is unknown or
+ * the backend isn't built in.
+ */
+extern int alarm_queue_init (alarm_queue_t *queue, const char *backend);
+
+/*
+ * Add an alarm, or take it off the queue before it expires.
+ */
+extern void alarm_queue_insert (alarm_queue_t *queue, alarm_t *alarm);
+extern void alarm_queue_remove (alarm_queue_t *queue, alarm_t *alarm);
+
+/*
+ * Add a chain (through alarm_t.link) of "count" alarms at once. The
+ * list sorts the chain and merges it in one pass and the heap may
+ * rebuild itself bottom-up, both cheaper than inserting one by one.
+ */
+extern void alarm_queue_insert_batch (alarm_queue_t *queue, alarm_t *batch, int count);
+
+/*
+ * Change the expiration time of a queued alarm and move it to its
+ * new position (decrease-key or increase-key).
+ */
+extern void alarm_queue_update (alarm_queue_t *queue, alarm_t *alarm, alarm_time_t time);
+
+/*
+ * Return the time at which the queue next needs attention, or 0
+ * if it is empty. For the list and heap this is the deadline of
+ * the earliest alarm; the wheel may report an earlier time at
+ * which a coarse bucket must be cascaded, after which
+ * alarm_queue_expire can return NULL and the caller simply asks
+ * again.
+ */
+extern alarm_time_t alarm_queue_next_time (alarm_queue_t *queue);
+
+/*
+ * Remove and return one alarm whose time is at or before "now",
+ * or NULL if none is due.
+ */
+extern alarm_t *alarm_queue_expire (alarm_queue_t *queue, alarm_time_t now);
+
+/*
+ * Remove every alarm due at or before "now" in one pass and return
+ * them as a chain through alarm_t.link, earliest first, or NULL if
+ * none is due. The alarms are off the queue, so the chain can be
+ * walked after the queue's lock has been dropped.
+ */
+extern alarm_t *alarm_queue_expire_batch (alarm_queue_t *queue, alarm_time_t now);
+
+/*
+ * Call "visit" for every alarm on the queue, in no particular
+ * order. The visitor must not modify the queue.
+ */
+extern void alarm_queue_foreach (alarm_queue_t *queue, alarm_visit_t visit, void *arg);
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * alarm_queue_bench.c
+ *
+ * Compare the timer queue backends in alarm_queue.c on the same
+ * workload: insert "count" alarms with nanosecond deadlines spread
+ * uniformly over "span" seconds from the start of each run, cancel every tenth one, then expire
+ * the rest by stepping the clock to each reported deadline; then
+ * insert the same alarms into a fresh queue as one batch. The queue
+ * is driven directly, without threads or locks, so the numbers
+ * reflect only the data structure. A build with one backend (see
+ * alarm_queue.h) runs only that one, calling it directly.
+ *
+ * usage: alarm_queue_bench [count [span]]
+ */
+#include <time.h>
+#include "errors.h"
+#include "alarm_queue.h"
+
+/*
+ * The list backend inserts in O(n), so past this many alarms it
+ * would dominate the run without telling us anything new.
+ */
+#define LIST_LIMIT      50000
+
+static double elapsed (struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start -> tv_sec)
+        + (end.tv_nsec - start -> tv_nsec) / 1e9;
+}
+
+/*
+ * Expire everything on the queue, checking that alarms come out in
+ * deadline order (to within "slop") and never early. Returns how
+ * many expired.
+ */
+static int drain (const char *backend, alarm_queue_t *queue, alarm_time_t slop)
+{
+    alarm_time_t now, last = 0;
+    alarm_t *alarm;
+    int expired = 0;
+
+    while (queue -> count > 0) {
+        now = alarm_queue_next_time (queue);
+        while ((alarm = alarm_queue_expire (queue, now)) != NULL) {
+            if (alarm -> time < last - slop || alarm -> time > now) {
+                fprintf (stderr, "%s: alarm %d expired out of order\n",
+                    backend, alarm -> alarm_id);
+                exit (1);
+            }
+            if (alarm -> time > last) {
+                last = alarm -> time;
+            }
+            expired++;
+        }
+    }
+    return expired;
+}
+
+static void bench (const char *backend, alarm_t *alarms, int count, alarm_time_t *times)
+{
+    alarm_queue_t queue;
+    struct timespec start;
+    double insert_secs, cancel_secs, expire_secs, batch_secs;
+    alarm_time_t base = alarm_now (), slop = 0;
+    int index, cancelled = 0, expired;
+
+    if (alarm_queue_init (&queue, backend) != 0) {
+        fprintf (stderr, "Unknown backend %s\n", backend);
+        exit (1);
+    }
+
+    // The wheel only orders alarms to within one tick
+    if (strcmp (backend, "wheel") == 0) {
+        slop = ALARM_WHEEL_TICK;
+    }
+    for (index = 0; index < count; index++) {
+        alarms[index].alarm_id = index;
+        alarms[index].time = base + times[index];
+    }
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (index = 0; index < count; index++) {
+        alarm_queue_insert (&queue, &alarms[index]);
+    }
+    insert_secs = elapsed (&start);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (index = 0; index < count; index += 10) {
+        alarm_queue_remove (&queue, &alarms[index]);
+        cancelled++;
+    }
+    cancel_secs = elapsed (&start);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    expired = drain (backend, &queue, slop);
+    expire_secs = elapsed (&start);
+
+    if (expired + cancelled != count) {
+        fprintf (stderr, "%s: lost %d alarms\n", backend, count - expired - cancelled);
+        exit (1);
+    }
+    free (queue.heap);
+
+    alarm_queue_init (&queue, backend);
+    for (index = 0; index < count; index++) {
+        alarms[index].time = base + times[index];
+        alarms[index].link = index + 1 < count ? &alarms[index + 1] : NULL;
+    }
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    alarm_queue_insert_batch (&queue, alarms, count);
+    batch_secs = elapsed (&start);
+    if (drain (backend, &queue, slop) != count) {
+        fprintf (stderr, "%s: batch insert lost alarms\n", backend);
+        exit (1);
+    }
+
+    printf ("%-6s %10.0f %10.0f %10.0f %10.0f\n", backend, count / insert_secs,
+        cancelled / cancel_secs, expired / expire_secs, count / batch_secs);
+    free (queue.heap);
+}
+
+int main (int argc, char *argv[])
+{
+    static const char *backends[] = { "list", "heap", "wheel" };
+    int count = argc > 1 ? atoi (argv[1]) : 100000;
+    int span = argc > 2 ? atoi (argv[2]) : 3600;
+    alarm_queue_t probe;
+    alarm_t *alarms;
+    alarm_time_t *times;
+    int index;
+
+    if (count <= 0 || span <= 0) {
+        fprintf (stderr, "usage: %s [count [span]]\n", argv[0]);
+        exit (1);
+    }
+    alarms = aligned_alloc (_Alignof (alarm_t), count * sizeof (alarm_t));
+    times = malloc (count * sizeof (alarm_time_t));
+    if (alarms == NULL || times == NULL) {
+        errno_abort ("Allocate alarms");
+    }
+    memset (alarms, 0, count * sizeof (alarm_t));
+    srand (1);
+    for (index = 0; index < count; index++) {
+        times[index] = ALARM_NSEC_PER_SEC * (1 + rand () % span)
+            + rand () % ALARM_NSEC_PER_SEC;
+    }
+
+    printf ("%d alarms over %d seconds (ops/sec)\n", count, span);
+    printf ("%-6s %10s %10s %10s %10s\n", "queue", "insert", "cancel", "expire", "batch");
+    for (index = 0; index < sizeof (backends) / sizeof (backends[0]); index++) {
+        if (alarm_queue_init (&probe, backends[index]) != 0) {
+            printf ("%-6s (not built in)\n", backends[index]);
+            continue;
+        }
+        if (strcmp (backends[index], "list") == 0 && count > LIST_LIMIT) {
+            printf ("%-6s (skipped above %d alarms)\n", backends[index], LIST_LIMIT);
+            continue;
+        }
+        bench (backends[index], alarms, count, times);
+    }
+    free (alarms);
+    free (times);
+    return 0;
+}
@@ -0,0 +1,1072 @@
+/*
+ * alarm_sched.c
+ *
+ * Each shard runs the classic alarm_cond.c protocol on its own:
+ * current_alarm is the time the shard's expiry thread is waiting
+ * for, and a producer that finds the thread waiting signals the
+ * shard's condition variable. Because producers read current_alarm
+ * without the lock, it is atomic and has two special values: 0
+ * while the thread is busy (it will look at the intake before
+ * sleeping again, so nobody needs to wake it) and ALARM_IDLE while
+ * it waits on an empty queue.
+ *
+ * Every request is answered when the thread takes it off the
+ * intake, so even one due after the current deadline must wake a
+ * waiting thread. Only the push that finds the intake empty does
+ * this: any later push lands on a non-empty intake, whose first
+ * pusher has already woken the thread or seen it busy, so a burst
+ * of requests costs one signal.
+ *
+ * Only the expiry thread touches its shard's queue and indexes. The
+ * shard mutex now exists for the condition variable: the thread
+ * holds it except while waiting or delivering, and producers take
+ * it only around a signal.
+ *
+ * With a timer slack, an alarm may fire up to that much late, as
+ * with Linux timerslack: the thread waits for its earliest deadline
+ * plus the slack and then expires everything due by then in one
+ * batch, so deadlines that fall within one window cost one wake-up.
+ * current_alarm is then the time the thread will wake, and a
+ * producer doesn't signal a thread due to wake within the slack
+ * anyway, which delays the answer to its request by no more.
+ *
+ * No wake-up is lost: the thread publishes current_alarm before it
+ * looks at the intake a last time, and a producer pushes before it
+ * reads current_alarm, so either the thread sees the request or
+ * the producer sees it waiting and signals -- which, under the
+ * mutex, cannot happen before the thread is waiting.
+ *
+ * A shard may wait on a timerfd instead, set for an absolute
+ * CLOCK_MONOTONIC time with the thread's own timer slack at its
+ * least, together with an eventfd that producers write where they
+ * would have signaled; the eventfd counts, so a write before the
+ * thread polls isn't lost either. With a spin threshold, the thread
+ * sleeps only until that long before its wake time and spins the
+ * rest with current_alarm 0, so producers leave it to find their
+ * requests on the intake.
+ */
+#define _GNU_SOURCE
+#include <limits.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include "errors.h"
+#include "alarm_sched.h"
+#include "alarm_index.h"
+#include "alarm_group.h"
+#include "alarm_pool.h"
+#include "alarm_stats.h"
+
+#define ALARM_IDLE      LLONG_MAX
+
+#if defined (__x86_64__) || defined (__i386__)
+# define ALARM_SPIN_PAUSE()     __builtin_ia32_pause ()
+#else
+# define ALARM_SPIN_PAUSE()     ((void) 0)
+#endif
+
+typedef struct alarm_shard_tag {
+    alarm_sched_t       *sched;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;           /* CLOCK_MONOTONIC */
+    _Atomic (alarm_t *) intake;         /* requests, newest first */
+    atomic_llong        current_alarm;
+    alarm_queue_t       queue;
+    alarm_index_t       index;          /* every alarm on "queue" */
+    alarm_groups_t      groups;         /* and by group */
+    pthread_t           thread;
+    int                 cpu;            /* pinned to, or -1 */
+    int                 stopping;       /* set by alarm_sched_destroy */
+    int                 timer_fd;       /* timerfd wait, or -1 */
+    int                 wake_fd;        /* its eventfd, or -1 */
+    alarm_time_t        spin;           /* spin threshold, ns */
+} alarm_shard_t;
+
+/*
+ * A group cancel sends a carrier to every shard; each carrier's
+ * prev points to the request built by alarm_cancel_group, whose
+ * queue_index counts the shards yet to finish and whose alarm_id
+ * counts the alarms removed so far. A listing works the same way,
+ * its request also gathering the shards' snapshots on link.
+ * cancel_mutex protects all three.
+ */
+struct alarm_sched_tag {
+    alarm_shard_t       *shards;
+    int                 shard_count;
+    int                 started;        /* expiry threads running */
+    alarm_deliver_t     deliver;
+    alarm_report_t      report;
+    void                *arg;           /* for deliver and report */
+    alarm_time_t        slack;
+    pthread_mutex_t     cancel_mutex;
+    alarm_admit_t       admit;          /* limits on pending alarms */
+};
+
+/*
+ * The shard that owns an alarm_id.
+ */
+static alarm_shard_t *alarm_shard (alarm_sched_t *sched, int alarm_id)
+{
+    return &sched -> shards[((unsigned int) alarm_id * 2654435769u >> 8)
+        % (unsigned int) sched -> shard_count];
+}
+
+/*
+ * Pass the outcome of a request to the report routine.
+ */
+static void alarm_report (alarm_shard_t *shard, alarm_t *alarm, int result)
+{
+    shard -> sched -> report (alarm, result, shard -> sched -> arg);
+}
+
+static void alarm_shard_lock (alarm_shard_t *shard)
+{
+    int status = pthread_mutex_lock (&shard -> mutex);
+
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+}
+
+static void alarm_shard_unlock (alarm_shard_t *shard)
+{
+    int status = pthread_mutex_unlock (&shard -> mutex);
+
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+/*
+ * Wake the expiry thread, which the caller has seen waiting. The
+ * shard must be locked.
+ */
+static void alarm_shard_signal (alarm_shard_t *shard)
+{
+    uint64_t one = 1;
+    int status;
+
+    if (shard -> wake_fd >= 0) {
+        if (write (shard -> wake_fd, &one, sizeof (one)) != sizeof (one) && errno != EAGAIN) {
+            errno_abort ("Signal eventfd");
+        }
+        return;
+    }
+    status = pthread_cond_signal (&shard -> cond);
+    if (status != 0) {
+        err_abort (status, "Signal cond");
+    }
+}
+
+/*
+ * Wait on a timerfd shard's descriptors until "wake" (forever if it
+ * is ALARM_IDLE) or until a producer sets current_alarm to 0. The
+ * shard is unlocked meanwhile.
+ */
+static void alarm_shard_poll (alarm_shard_t *shard, alarm_time_t wake)
+{
+    struct itimerspec timer;
+    struct pollfd fds[2];
+    uint64_t count;
+
+    memset (&timer, 0, sizeof (timer));
+    if (wake != ALARM_IDLE) {
+        alarm_timespec (wake, &timer.it_value);
+    }
+    if (timerfd_settime (shard -> timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) != 0) {
+        errno_abort ("Set timerfd");
+    }
+    fds[0].fd = shard -> timer_fd;
+    fds[1].fd = shard -> wake_fd;
+    fds[0].events = fds[1].events = POLLIN;
+
+    alarm_shard_unlock (shard);
+    while (atomic_load (&shard -> current_alarm) == wake) {
+        if (poll (fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errno_abort ("Poll timerfd");
+        }
+        if (fds[1].revents & POLLIN) {
+            if (read (shard -> wake_fd, &count, sizeof (count)) < 0 && errno != EAGAIN) {
+                errno_abort ("Read eventfd");
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            if (read (shard -> timer_fd, &count, sizeof (count)) < 0 && errno != EAGAIN) {
+                errno_abort ("Read timerfd");
+            }
+            break;
+        }
+    }
+    alarm_shard_lock (shard);
+}
+
+/*
+ * Push a chain of requests, "first" through "last" linked newest
+ * first, onto a shard's intake with one compare-and-swap, and wake
+ * the expiry thread if this made the intake non-empty while it was
+ * waiting (and is not about to wake within the slack). Setting
+ * current_alarm to 0 ends its wait loop.
+ */
+static void alarm_shard_push (alarm_shard_t *shard, alarm_t *first, alarm_t *last)
+{
+    alarm_t *head = atomic_load (&shard -> intake);
+    alarm_time_t wake, slack = shard -> sched -> slack;
+    STATS_TIMER (timer);
+
+    do {
+        last -> link = head;
+    } while (!atomic_compare_exchange_weak (&shard -> intake, &head, first));
+
+    if (head == NULL && (wake = atomic_load (&shard -> current_alarm)) != 0) {
+        if (slack > 0 && wake != ALARM_IDLE && wake - alarm_now () <= slack) {
+            return;
+        }
+        STATS_START (timer);
+        alarm_shard_lock (shard);
+        STATS_WAIT (ALARM_SITE_PUSH, timer);
+        if (atomic_load (&shard -> current_alarm) != 0) {
+            atomic_store (&shard -> current_alarm, 0);
+            alarm_shard_signal (shard);
+        }
+        STATS_HOLD (ALARM_SITE_PUSH, timer);
+        alarm_shard_unlock (shard);
+    }
+}
+
+/*
+ * New alarms gathered by alarm_intake, to go onto the queue with one
+ * alarm_queue_insert_batch.
+ */
+typedef struct alarm_batch_tag {
+    alarm_t             *first;
+    alarm_t             **last;
+    int                 count;
+} alarm_batch_t;
+
+static void alarm_batch_flush (alarm_shard_t *shard, alarm_batch_t *batch)
+{
+    *batch -> last = NULL;
+    alarm_queue_insert_batch (&shard -> queue, batch -> first, batch -> count);
+    batch -> first = NULL;
+    batch -> last = &batch -> first;
+    batch -> count = 0;
+}
+
+/*
+ * Take a pending alarm off the shard's queue and indexes and free it,
+ * reporting it as ALARM_REMOVED first.
+ */
+static void alarm_remove (alarm_shard_t *shard, alarm_t *alarm)
+{
+    alarm_queue_remove (&shard -> queue, alarm);
+    alarm_index_remove (&shard -> index, alarm);
+    alarm_group_remove (&shard -> groups, alarm);
+    alarm_report (shard, alarm, ALARM_REMOVED);
+    alarm_admit_give (&shard -> sched -> admit, alarm);
+    alarm_message_release (alarm -> message);
+    alarm_free (alarm);
+}
+
+/*
+ * Remove this shard's alarms in the carrier's group. The shard that
+ * finishes last reports the whole cancel, with the total removed in
+ * alarm_id.
+ */
+static void alarm_cancel_members (alarm_shard_t *shard, alarm_t *carrier)
+{
+#ifdef NO_ALARM_GROUPS
+    alarm_t *alarm, *next;
+    unsigned int bucket;
+#else
+    alarm_members_t *members;
+#endif
+    alarm_t *cancel = carrier -> prev;
+    int count = 0, status, last;
+    STATS_TIMER (timer);
+
+#ifdef NO_ALARM_GROUPS
+    // Removing an alarm leaves the rest of its index chain in place
+    for (bucket = 0; bucket < shard -> index.size; bucket++) {
+        for (alarm = shard -> index.buckets[bucket]; alarm != NULL; alarm = next) {
+            next = alarm -> hash_link;
+            if (alarm -> group_id == carrier -> group_id) {
+                alarm_remove (shard, alarm);
+                count++;
+            }
+        }
+    }
+#else
+    // Taking the last member each time leaves the rest in place
+    while ((members = alarm_group_find (&shard -> groups, carrier -> group_id)) != NULL) {
+        alarm_remove (shard, members -> heap[members -> count - 1].alarm);
+        count++;
+    }
+#endif
+
+    STATS_START (timer);
+    status = pthread_mutex_lock (&shard -> sched -> cancel_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    STATS_WAIT (ALARM_SITE_CANCEL, timer);
+    cancel -> alarm_id += count;
+    last = --cancel -> queue_index == 0;
+    STATS_HOLD (ALARM_SITE_CANCEL, timer);
+    status = pthread_mutex_unlock (&shard -> sched -> cancel_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    if (last) {
+        alarm_report (shard, cancel, ALARM_CANCELLED);
+        alarm_free (cancel);
+    }
+}
+
+/*
+ * A copy of a pending alarm, sharing its message, to be delivered
+ * or listed while the alarm itself stays on the queue. The caller
+ * sets the copy's link.
+ */
+static alarm_t *alarm_copy (alarm_t *alarm)
+{
+    alarm_t *copy = alarm_alloc ();
+
+    copy -> time = alarm -> time;
+    copy -> alarm_id = alarm -> alarm_id;
+    copy -> group_id = alarm -> group_id;
+    copy -> message = alarm_message_share (alarm -> message);
+    copy -> duration = alarm -> duration;
+    copy -> request = alarm -> request;
+    copy -> client = alarm -> client;
+    copy -> periodic = alarm -> periodic;
+    return copy;
+}
+
+/*
+ * Copy this shard's alarms -- all of them, or those in the carrier's
+ * group -- onto the listing. The shard that finishes last reports
+ * the listing, with the total copied in alarm_id. Only the copying
+ * happens here, on the expiry thread; the report routine formats
+ * the snapshot wherever it likes.
+ */
+static void alarm_snapshot (alarm_shard_t *shard, alarm_t *carrier)
+{
+    alarm_t *listing = carrier -> prev, *first = NULL, **last = &first, *alarm;
+#ifndef NO_ALARM_GROUPS
+    alarm_members_t *members;
+    int index;
+#endif
+    unsigned int bucket;
+    int count = 0, status, done;
+    STATS_TIMER (timer);
+
+#ifndef NO_ALARM_GROUPS
+    if (carrier -> request == ALARM_LIST_GROUP) {
+        members = alarm_group_find (&shard -> groups, carrier -> group_id);
+        for (index = 0; members != NULL && index < members -> count; index++) {
+            *last = alarm_copy (members -> heap[index].alarm);
+            last = &(*last) -> link;
+            count++;
+        }
+    } else
+#endif
+    {
+        for (bucket = 0; bucket < shard -> index.size; bucket++) {
+            for (alarm = shard -> index.buckets[bucket]; alarm != NULL; alarm = alarm -> hash_link) {
+                if (carrier -> request == ALARM_LIST_GROUP
+                    && alarm -> group_id != carrier -> group_id) {
+                    continue;
+                }
+                *last = alarm_copy (alarm);
+                last = &(*last) -> link;
+                count++;
+            }
+        }
+    }
+
+    STATS_START (timer);
+    status = pthread_mutex_lock (&shard -> sched -> cancel_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    STATS_WAIT (ALARM_SITE_CANCEL, timer);
+    *last = listing -> link;
+    listing -> link = first;
+    listing -> alarm_id += count;
+    done = --listing -> queue_index == 0;
+    STATS_HOLD (ALARM_SITE_CANCEL, timer);
+    status = pthread_mutex_unlock (&shard -> sched -> cancel_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    if (done) {
+        alarm_report (shard, listing, ALARM_LISTED);
+        alarm_free (listing);
+    }
+}
+
+/*
+ * Apply one request to the shard's queue and indexes, and report the
+ * outcome. A new alarm goes into the indexes (so a duplicate later in
+ * the same intake is caught) and onto "batch"; the batch is put on
+ * the queue before any change or cancel, which may be to one of its
+ * alarms. Requests that don't end up on the queue -- duplicates and
+ * carriers -- are freed here.
+ */
+static void alarm_apply (alarm_shard_t *shard, alarm_t *request, alarm_batch_t *batch)
+{
+    alarm_t *alarm = alarm_index_find (&shard -> index, request -> alarm_id);
+
+    /*
+     * LOCKING PROTOCOL:
+     *
+     * Only the shard's expiry thread calls this, with the shard's
+     * mutex locked. A group cancel also takes the scheduler's
+     * cancel_mutex, briefly and with nothing else locked under it.
+     */
+    if (request -> request == ALARM_START || request -> request == ALARM_RESTORE) {
+        if (alarm != NULL) {
+            alarm_report (shard, request, ALARM_EXISTS);
+            alarm_admit_give (&shard -> sched -> admit, request);
+            alarm_message_release (request -> message);
+            alarm_free (request);
+            return;
+        }
+        alarm_index_insert (&shard -> index, request);
+        alarm_group_insert (&shard -> groups, request);
+        *batch -> last = request;
+        batch -> last = &request -> link;
+        batch -> count++;
+        alarm_report (shard, request, ALARM_STARTED);
+        return;
+    }
+
+    if (batch -> count > 0) {
+        alarm_batch_flush (shard, batch);
+    }
+    if (request -> request == ALARM_CANCEL_GROUP) {
+        alarm_cancel_members (shard, request);
+        alarm_free (request);
+        return;
+    }
+    if (request -> request == ALARM_LIST || request -> request == ALARM_LIST_GROUP) {
+        alarm_snapshot (shard, request);
+        alarm_free (request);
+        return;
+    }
+
+    if (alarm == NULL) {
+        alarm_report (shard, request, ALARM_NOT_FOUND);
+        alarm_message_release (request -> message);
+    } else if (request -> request == ALARM_CANCEL) {
+        alarm_remove (shard, alarm);
+        alarm_report (shard, request, ALARM_CANCELLED);
+    } else {
+        alarm_admit_change (&shard -> sched -> admit, alarm, request);
+        alarm -> duration = request -> duration;
+        alarm_message_release (alarm -> message);
+        alarm -> message = request -> message;
+        alarm_queue_update (&shard -> queue, alarm, request -> time);
+        if (alarm -> group_id == request -> group_id) {
+            alarm_group_update (&shard -> groups, alarm);
+        } else {
+            alarm_group_remove (&shard -> groups, alarm);
+            alarm -> group_id = request -> group_id;
+            alarm_group_insert (&shard -> groups, alarm);
+        }
+        alarm_report (shard, request, ALARM_CHANGED);
+    }
+    alarm_free (request);
+}
+
+/*
+ * Take everything on the shard's intake and apply it in the order
+ * it was submitted, then queue the new alarms as one batch.
+ */
+static void alarm_intake (alarm_shard_t *shard)
+{
+    alarm_t *request = atomic_exchange (&shard -> intake, NULL);
+    alarm_t *fifo = NULL, *next;
+    alarm_batch_t batch = { NULL, &batch.first, 0 };
+
+    while (request != NULL) {
+        next = request -> link;
+        request -> link = fifo;
+        fifo = request;
+        request = next;
+    }
+    while (fifo != NULL) {
+        next = fifo -> link;
+        alarm_apply (shard, fifo, &batch);
+        fifo = next;
+    }
+    if (batch.count > 0) {
+        alarm_batch_flush (shard, &batch);
+    }
+}
+
+/*
+ * Queue an expired periodic alarm again, one period after its
+ * previous deadline, and return a copy of it, as it was when it
+ * expired, to deliver in its place. The deadline steps on from
+ * where it was rather than from "now", so lateness in one firing
+ * doesn't push back the rest; a period missed entirely (the shard
+ * fell more than a period behind) is skipped, not fired late. The
+ * copy is the one allocation a firing costs.
+ */
+static alarm_t *alarm_rearm (alarm_shard_t *shard, alarm_t *alarm, alarm_time_t now)
+{
+    alarm_t *fired = alarm_copy (alarm);
+
+    fired -> link = alarm -> link;
+
+    alarm -> time += alarm -> duration;
+    if (alarm -> time <= now) {
+        alarm -> time += (now - alarm -> time) / alarm -> duration * alarm -> duration
+            + alarm -> duration;
+    }
+    alarm_queue_insert (&shard -> queue, alarm);
+    alarm_group_update (&shard -> groups, alarm);
+    alarm_report (shard, fired, ALARM_REARMED);
+    return fired;
+}
+
+/*
+ * A shard's expiry thread start routine.
+ */
+static void *alarm_thread (void *arg)
+{
+    alarm_shard_t *shard = arg;
+    alarm_sched_t *sched = shard -> sched;
+    alarm_t *alarm, *batch, **last;
+    struct timespec cond_time;
+    alarm_time_t now, next, wake, sleep;
+    int status;
+    STATS_TIMER (timer);
+
+    // A timerfd is only as precise as the thread's timer slack
+    if (shard -> timer_fd >= 0) {
+        prctl (PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+    }
+
+    /*
+     * Loop until alarm_sched_destroy stops us (or the process
+     * exits), processing the shard's alarms. Lock the mutex at the
+     * start -- it will be unlocked during condition waits and while
+     * expired alarms are delivered. The lock's hold time is counted
+     * from each time the thread gets it back until it next lets go.
+     */
+    STATS_START (timer);
+    alarm_shard_lock (shard);
+    STATS_WAIT (ALARM_SITE_EXPIRY, timer);
+
+    while (1) {
+        // Busy: pick up whatever producers have submitted
+        atomic_store (&shard -> current_alarm, 0);
+        alarm_intake (shard);
+        STATS_DEPTH (shard -> queue.count);
+
+        // Every request submitted before the stop has been answered
+        if (shard -> stopping) {
+            break;
+        }
+
+        /*
+         * If the queue is empty, wait until a request arrives.
+         * Setting current_alarm to ALARM_IDLE tells producers that
+         * any request needs a signal.
+         */
+        if (shard -> queue.count == 0) {
+            atomic_store (&shard -> current_alarm, ALARM_IDLE);
+            if (atomic_load (&shard -> intake) != NULL) {
+                continue;
+            }
+            STATS_HOLD (ALARM_SITE_EXPIRY, timer);
+            if (shard -> timer_fd >= 0) {
+                alarm_shard_poll (shard, ALARM_IDLE);
+            } else {
+                status = pthread_cond_wait (&shard -> cond, &shard -> mutex);
+                if (status != 0) {
+                    err_abort (status, "Wait on cond");
+                }
+            }
+            STATS_START (timer);
+            continue;
+        }
+
+        /*
+         * Ask the queue when it next needs attention. Alarms stay
+         * queued while we wait, so an earlier request simply changes
+         * the answer and there is nothing to requeue.
+         */
+        next = alarm_queue_next_time (&shard -> queue);
+        now = alarm_now ();
+
+        if (next > now) {
+            wake = next + sched -> slack;
+
+            /*
+             * Close enough to spin out: stay busy, watching the
+             * intake, rather than pay a wake-up's latency.
+             */
+            if (wake - now <= shard -> spin) {
+                while (alarm_now () < wake && atomic_load (&shard -> intake) == NULL) {
+                    ALARM_SPIN_PAUSE ();
+                }
+                continue;
+            }
+
+            // Sleep until the spin phase begins
+            sleep = wake - shard -> spin;
+            atomic_store (&shard -> current_alarm, sleep);
+            if (atomic_load (&shard -> intake) != NULL) {
+                continue;
+            }
+            STATS_HOLD (ALARM_SITE_EXPIRY, timer);
+
+            if (shard -> timer_fd >= 0) {
+                alarm_shard_poll (shard, sleep);
+            } else {
+                alarm_timespec (sleep, &cond_time);
+                while (atomic_load (&shard -> current_alarm) == sleep) {
+                    status = pthread_cond_timedwait (&shard -> cond, &shard -> mutex, &cond_time);
+                    if (status == ETIMEDOUT) {
+                        break;
+                    }
+                    if (status != 0) {
+                        err_abort (status, "Cond timedwait");
+                    }
+                }
+            }
+
+            // Re-examine the queue: the deadline passed or moved
+            STATS_START (timer);
+            continue;
+        }
+
+        /*
+         * Detach everything that is due in one pass. The wheel may
+         * only have cascaded, leaving nothing due yet.
+         */
+        batch = alarm_queue_expire_batch (&shard -> queue, now);
+        if (batch == NULL) {
+            continue;
+        }
+        for (last = &batch; (alarm = *last) != NULL; last = &alarm -> link) {
+            STATS_FIRED (alarm, now);
+
+            // A periodic alarm stays pending; a copy is delivered
+            if (alarm -> periodic && alarm -> duration > 0) {
+                *last = alarm = alarm_rearm (shard, alarm, now);
+                continue;
+            }
+            alarm_index_remove (&shard -> index, alarm);
+            alarm_group_remove (&shard -> groups, alarm);
+            alarm_admit_give (&sched -> admit, alarm);
+        }
+        STATS_DEPTH (shard -> queue.count);
+
+        /*
+         * The batch is off the queue and out of the indexes, so it can
+         * be delivered without holding the shard's mutex. Requests
+         * that arrive meanwhile see current_alarm 0 and don't
+         * signal; the loop picks them up next.
+         */
+        STATS_HOLD (ALARM_SITE_EXPIRY, timer);
+        alarm_shard_unlock (shard);
+        sched -> deliver (batch, sched -> arg);
+        STATS_START (timer);
+        alarm_shard_lock (shard);
+        STATS_WAIT (ALARM_SITE_EXPIRY, timer);
+    }
+    STATS_HOLD (ALARM_SITE_EXPIRY, timer);
+    alarm_shard_unlock (shard);
+    return NULL;
+}
+
+alarm_sched_t *alarm_sched_create (int shards, const char *backend, alarm_time_t slack,
+    alarm_deliver_t deliver, alarm_report_t report, void *arg)
+{
+    pthread_condattr_t cond_attr;
+    alarm_sched_t *sched;
+    int index, status;
+
+    sched = (alarm_sched_t*)calloc (1, sizeof (alarm_sched_t));
+    if (sched == NULL) {
+        errno_abort ("Allocate scheduler");
+    }
+    sched -> shards = (alarm_shard_t*)calloc (shards, sizeof (alarm_shard_t));
+    if (sched -> shards == NULL) {
+        errno_abort ("Allocate shards");
+    }
+    sched -> shard_count = shards;
+    sched -> slack = slack;
+    sched -> deliver = deliver;
+    sched -> report = report;
+    sched -> arg = arg;
+    status = pthread_mutex_init (&sched -> cancel_mutex, NULL);
+    if (status != 0) {
+        err_abort (status, "Init mutex");
+    }
+    alarm_admit_init (&sched -> admit);
+
+    /*
+     * Deadlines are on CLOCK_MONOTONIC, so the condition variables
+     * the expiry threads wait on must time out on the same clock.
+     */
+    status = pthread_condattr_init (&cond_attr);
+    if (status != 0) {
+        err_abort (status, "Init cond attr");
+    }
+    status = pthread_condattr_setclock (&cond_attr, CLOCK_MONOTONIC);
+    if (status != 0) {
+        err_abort (status, "Set cond clock");
+    }
+
+    for (index = 0; index < shards; index++) {
+        alarm_shard_t *shard = &sched -> shards[index];
+
+        if (alarm_queue_init (&shard -> queue, backend) != 0) {
+            pthread_condattr_destroy (&cond_attr);
+            sched -> shard_count = index;
+            alarm_sched_destroy (sched);
+            return NULL;
+        }
+        shard -> sched = sched;
+        shard -> timer_fd = shard -> wake_fd = -1;
+        atomic_init (&shard -> intake, NULL);
+        atomic_init (&shard -> current_alarm, 0);
+        status = pthread_mutex_init (&shard -> mutex, NULL);
+        if (status != 0) {
+            err_abort (status, "Init mutex");
+        }
+        status = pthread_cond_init (&shard -> cond, &cond_attr);
+        if (status != 0) {
+            err_abort (status, "Init cond");
+        }
+    }
+    pthread_condattr_destroy (&cond_attr);
+    return sched;
+}
+
+int alarm_sched_wait (alarm_sched_t *sched, int shard, const char *strategy,
+    alarm_time_t spin)
+{
+    alarm_shard_t *target;
+    int index, timed;
+
+    if (strcmp (strategy, "cond") == 0) {
+        timed = 0;
+    } else if (strcmp (strategy, "timerfd") == 0) {
+        timed = 1;
+    } else {
+        return -1;
+    }
+    if (shard < -1 || shard >= sched -> shard_count) {
+        return -1;
+    }
+
+    for (index = 0; index < sched -> shard_count; index++) {
+        if (shard != -1 && index != shard) {
+            continue;
+        }
+        target = &sched -> shards[index];
+        target -> spin = spin;
+        if (timed && target -> timer_fd < 0) {
+            target -> timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+            target -> wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (target -> timer_fd < 0 || target -> wake_fd < 0) {
+                errno_abort ("Create timerfd");
+            }
+        } else if (!timed && target -> timer_fd >= 0) {
+            close (target -> timer_fd);
+            close (target -> wake_fd);
+            target -> timer_fd = target -> wake_fd = -1;
+        }
+    }
+    return 0;
+}
+
+void alarm_sched_start (alarm_sched_t *sched)
+{
+    pthread_attr_t thread_attr;
+    cpu_set_t allowed, cpus;
+    int cpu_list[CPU_SETSIZE], cpu_count = 0;
+    int index, status;
+
+    // Shards are spread over the CPUs this process may run on
+    if (sched_getaffinity (0, sizeof (allowed), &allowed) == 0) {
+        for (index = 0; index < CPU_SETSIZE; index++) {
+            if (CPU_ISSET (index, &allowed)) {
+                cpu_list[cpu_count++] = index;
+            }
+        }
+    }
+
+    /*
+     * Start one expiry thread per shard, each pinned to its own CPU
+     * (round-robin if there are more shards than CPUs).
+     */
+    for (index = 0; index < sched -> shard_count; index++) {
+        alarm_shard_t *shard = &sched -> shards[index];
+
+        status = pthread_attr_init (&thread_attr);
+        if (status != 0) {
+            err_abort (status, "Init thread attr");
+        }
+        shard -> cpu = -1;
+        if (cpu_count > 0) {
+            shard -> cpu = cpu_list[index % cpu_count];
+            CPU_ZERO (&cpus);
+            CPU_SET (shard -> cpu, &cpus);
+            status = pthread_attr_setaffinity_np (&thread_attr, sizeof (cpus), &cpus);
+            if (status != 0) {
+                err_abort (status, "Set thread affinity");
+            }
+        }
+        status = pthread_create (&shard -> thread, &thread_attr, alarm_thread, shard);
+        if (status != 0) {
+            err_abort (status, "Create alarm thread");
+        }
+        pthread_attr_destroy (&thread_attr);
+    }
+    sched -> started = 1;
+}
+
+#if defined (ALARM_BACKEND_ALL)
+# define BUILD_QUEUE    "all queue backends"
+#else
+# define BUILD_QUEUE    ALARM_QUEUE_DEFAULT " queue only"
+#endif
+#ifdef NO_ALARM_GROUPS
+# define BUILD_GROUPS   ", no group index"
+#else
+# define BUILD_GROUPS   ""
+#endif
+#ifdef NO_ALARM_POOL
+# define BUILD_POOL     ", no pool"
+#else
+# define BUILD_POOL     ""
+#endif
+#ifdef ALARM_STATS
+# define BUILD_STATS    ", stats"
+#else
+# define BUILD_STATS    ""
+#endif
+
+const char *alarm_sched_build (void)
+{
+    return BUILD_QUEUE BUILD_GROUPS BUILD_POOL BUILD_STATS;
+}
+
+/*
+ * Stop each expiry thread (under its shard's mutex, so the thread
+ * is either waiting or will see "stopping" before it waits again)
+ * and wait for it to finish, then free whatever is left: the
+ * alarms still pending, found through the alarm_id index, and the
+ * queues and indexes themselves.
+ */
+void alarm_sched_destroy (alarm_sched_t *sched)
+{
+    alarm_members_t *members, *next_members;
+    alarm_t *alarm, *next;
+    unsigned int bucket;
+    int index, status;
+
+    for (index = 0; index < sched -> shard_count && sched -> started; index++) {
+        alarm_shard_t *shard = &sched -> shards[index];
+
+        alarm_shard_lock (shard);
+        shard -> stopping = 1;
+        atomic_store (&shard -> current_alarm, 0);
+        alarm_shard_signal (shard);
+        alarm_shard_unlock (shard);
+        status = pthread_join (shard -> thread, NULL);
+        if (status != 0) {
+            err_abort (status, "Join alarm thread");
+        }
+    }
+
+    for (index = 0; index < sched -> shard_count; index++) {
+        alarm_shard_t *shard = &sched -> shards[index];
+
+        for (bucket = 0; bucket < shard -> index.size; bucket++) {
+            for (alarm = shard -> index.buckets[bucket]; alarm != NULL; alarm = next) {
+                next = alarm -> hash_link;
+                alarm_message_release (alarm -> message);
+                alarm_free (alarm);
+            }
+        }
+        for (bucket = 0; bucket < shard -> groups.size; bucket++) {
+            for (members = shard -> groups.buckets[bucket]; members != NULL; members = next_members) {
+                next_members = members -> hash_link;
+                free (members -> heap);
+                free (members);
+            }
+        }
+        free (shard -> index.buckets);
+        free (shard -> groups.buckets);
+        free (shard -> queue.heap);
+        pthread_mutex_destroy (&shard -> mutex);
+        pthread_cond_destroy (&shard -> cond);
+        if (shard -> timer_fd >= 0) {
+            close (shard -> timer_fd);
+            close (shard -> wake_fd);
+        }
+    }
+    pthread_mutex_destroy (&sched -> cancel_mutex);
+    alarm_admit_destroy (&sched -> admit);
+    free (sched -> shards);
+    free (sched);
+}
+
+void alarm_sched_limit (alarm_sched_t *sched, long alarms, int group, unsigned long bytes)
+{
+    sched -> admit.max_alarms = alarms;
+    sched -> admit.max_group = group;
+    sched -> admit.max_bytes = bytes;
+}
+
+int alarm_admit (alarm_sched_t *sched, alarm_t *alarm, int how)
+{
+    return alarm_admit_take (&sched -> admit, alarm, how);
+}
+
+void alarm_sched_usage (alarm_sched_t *sched, alarm_usage_t *usage)
+{
+    alarm_admit_usage (&sched -> admit, usage);
+}
+
+void alarm_submit (alarm_sched_t *sched, alarm_t *alarm)
+{
+    alarm -> request = ALARM_START;
+    alarm_shard_push (alarm_shard (sched, alarm -> alarm_id), alarm, alarm);
+}
+
+/*
+ * Split the chain by shard, building each shard's part newest first
+ * as the intake expects, then push each part in one go.
+ */
+void alarm_submit_batch (alarm_sched_t *sched, alarm_t *batch, int request)
+{
+    alarm_t **first, **last;
+    alarm_t *alarm;
+    int index;
+
+    first = (alarm_t**)calloc (sched -> shard_count, sizeof (alarm_t*));
+    last = (alarm_t**)calloc (sched -> shard_count, sizeof (alarm_t*));
+    if (first == NULL || last == NULL) {
+        errno_abort ("Allocate batch");
+    }
+
+    while (batch != NULL) {
+        alarm = batch;
+        batch = alarm -> link;
+        alarm -> request = request;
+        index = alarm_shard (sched, alarm -> alarm_id) - sched -> shards;
+        if (first[index] == NULL) {
+            last[index] = alarm;
+        }
+        alarm -> link = first[index];
+        first[index] = alarm;
+    }
+
+    for (index = 0; index < sched -> shard_count; index++) {
+        if (first[index] != NULL) {
+            alarm_shard_push (&sched -> shards[index], first[index], last[index]);
+        }
+    }
+    free (first);
+    free (last);
+}
+
+void alarm_change (alarm_sched_t *sched, int alarm_id, int group_id, alarm_time_t duration,
+    alarm_message_t message, int client)
+{
+    alarm_t *request = alarm_alloc ();
+
+    request -> request = ALARM_CHANGE;
+    request -> alarm_id = alarm_id;
+    request -> group_id = group_id;
+    request -> duration = duration;
+    request -> message = message;
+    request -> client = client;
+    request -> time = alarm_now () + duration;
+    alarm_shard_push (alarm_shard (sched, alarm_id), request, request);
+}
+
+void alarm_cancel (alarm_sched_t *sched, int alarm_id, int client)
+{
+    alarm_t *request = alarm_alloc ();
+
+    request -> request = ALARM_CANCEL;
+    request -> alarm_id = alarm_id;
+    request -> client = client;
+    request -> message = 0;
+    alarm_shard_push (alarm_shard (sched, alarm_id), request, request);
+}
+
+void alarm_cancel_group (alarm_sched_t *sched, int group_id, int client)
+{
+    alarm_t *cancel = alarm_alloc (), *carrier;
+    int index;
+
+    cancel -> request = ALARM_CANCEL_GROUP;
+    cancel -> alarm_id = 0;
+    cancel -> group_id = group_id;
+    cancel -> client = client;
+    cancel -> message = 0;
+    cancel -> queue_index = sched -> shard_count;
+    for (index = 0; index < sched -> shard_count; index++) {
+        carrier = alarm_alloc ();
+        carrier -> request = ALARM_CANCEL_GROUP;
+        carrier -> group_id = group_id;
+        carrier -> prev = cancel;
+        alarm_shard_push (&sched -> shards[index], carrier, carrier);
+    }
+}
+
+/*
+ * Send a listing request to every shard, as a group cancel does.
+ */
+static void alarm_list_request (alarm_sched_t *sched, int request, int group_id, int client)
+{
+    alarm_t *listing = alarm_alloc (), *carrier;
+    int index;
+
+    listing -> request = request;
+    listing -> link = NULL;
+    listing -> alarm_id = 0;
+    listing -> group_id = group_id;
+    listing -> client = client;
+    listing -> message = 0;
+    listing -> queue_index = sched -> shard_count;
+    for (index = 0; index < sched -> shard_count; index++) {
+        carrier = alarm_alloc ();
+        carrier -> request = request;
+        carrier -> alarm_id = 0;
+        carrier -> group_id = group_id;
+        carrier -> prev = listing;
+        alarm_shard_push (&sched -> shards[index], carrier, carrier);
+    }
+}
+
+void alarm_list (alarm_sched_t *sched, int client)
+{
+    alarm_list_request (sched, ALARM_LIST, 0, client);
+}
+
+void alarm_list_group (alarm_sched_t *sched, int group_id, int client)
+{
+    alarm_list_request (sched, ALARM_LIST_GROUP, group_id, client);
+}
@@ -0,0 +1,230 @@
+/*
+ * alarm_sched.h
+ *
+ * The alarm scheduler. Pending alarms are partitioned by alarm_id
+ * across a number of shards; each shard has its own timer queue,
+ * alarm_id and group indexes, mutex, condition variable and expiry
+ * thread, pinned to a CPU of its own, so shards never contend with
+ * each other. Producers go through alarm_submit, alarm_change and
+ * the cancels, which route each request to its shard, rather than
+ * touching any queue directly.
+ *
+ * Requests are pushed onto the shard's lock-free intake stack and
+ * applied by the shard's expiry thread the next time it wakes, so a
+ * producer never takes the scheduler lock except to wake a waiting
+ * thread when its request is the first on the intake. The outcome of
+ * each request is reported back through a callback, and expired
+ * alarms are handed, in batches and with no lock held, to the
+ * delivery routine given at startup.
+ *
+ * A scheduler is a handle, so a program may embed as many as it
+ * likes, each with its own shards and callbacks; nothing in it is
+ * tied to a process's stdin or output. The alarm pool and message
+ * arena are shared by all of them.
+ */
+#ifndef __alarm_sched_h
+#define __alarm_sched_h
+
+#include "alarm_queue.h"
+#include "alarm_admit.h"
+
+typedef struct alarm_sched_tag alarm_sched_t;
+
+/*
+ * Receives a chain (through alarm_t.link) of expired alarms, which
+ * are off every queue and index. The routine owns the alarms and
+ * must release their messages and free them. It is called from the
+ * shard's expiry thread, so it should not block for long. "arg" is
+ * the one given to alarm_sched_create.
+ */
+typedef void (*alarm_deliver_t) (alarm_t *batch, void *arg);
+
+/*
+ * alarm_t.request while an alarm is on a shard's intake.
+ */
+#define ALARM_START             0       /* a new alarm */
+#define ALARM_CHANGE            1       /* carries a change to alarm_id */
+#define ALARM_RESTORE           2       /* a new alarm the caller has
+                                           already recorded (reported
+                                           as ALARM_STARTED) */
+#define ALARM_CANCEL            3       /* removes alarm_id */
+#define ALARM_CANCEL_GROUP      4       /* removes group_id's alarms */
+#define ALARM_LIST              5       /* snapshots every alarm */
+#define ALARM_LIST_GROUP        6       /* snapshots group_id's alarms */
+
+/*
+ * Outcomes passed to the report routine.
+ */
+#define ALARM_STARTED           0       /* alarm is now scheduled */
+#define ALARM_EXISTS            1       /* alarm_id already pending */
+#define ALARM_CHANGED           2       /* alarm_id has been changed */
+#define ALARM_NOT_FOUND         3       /* no pending alarm_id to change
+                                           or cancel */
+#define ALARM_REMOVED           4       /* this alarm is being taken off
+                                           by a cancel */
+#define ALARM_CANCELLED         5       /* a cancel is done; for a group,
+                                           alarm_id is how many of its
+                                           alarms were removed */
+#define ALARM_REARMED           6       /* a periodic alarm expired and
+                                           is queued again; the alarm
+                                           passed is the copy about to
+                                           be delivered */
+#define ALARM_LISTED            7       /* a listing is done: alarm_id
+                                           alarms are chained on link */
+
+/*
+ * Receives the outcome of each submitted request: the alarm passed
+ * is the one given to alarm_submit, or the carrier alarm_change or
+ * a cancel built, whose fields are the ones the change applied.
+ * Each alarm a cancel removes is passed too, as ALARM_REMOVED,
+ * before the cancel's own outcome, and so is each firing of a
+ * periodic alarm, as ALARM_REARMED; the scheduler frees it (and
+ * releases its message) afterwards. It runs on the shard's expiry
+ * thread with the shard locked, so it must not block and must treat
+ * the alarm as read-only; the alarm is only valid until it returns.
+ * The one exception is a listing's snapshot, the chain on link of
+ * an ALARM_LISTED alarm, which the routine takes over and must free
+ * as a delivery routine frees a batch.
+ */
+typedef void (*alarm_report_t) (alarm_t *alarm, int result, void *arg);
+
+/*
+ * Create a scheduler of "shards" shards using the named queue
+ * backend, delivering and reporting through the given routines,
+ * which are passed "arg". "slack" is how late (in ns) an alarm may
+ * fire so that it can share a wake-up with others; 0 fires each at
+ * its deadline. Returns NULL if the backend is unknown.
+ *
+ * Requests may be submitted as soon as it is created; they are
+ * applied once alarm_sched_start has started the expiry threads.
+ */
+extern alarm_sched_t *alarm_sched_create (int shards, const char *backend,
+    alarm_time_t slack, alarm_deliver_t deliver, alarm_report_t report, void *arg);
+
+/*
+ * Choose how a shard's expiry thread waits for its next deadline
+ * ("shard" -1 for every shard); call this before alarm_sched_start.
+ * "strategy" is one of
+ *
+ *   cond       pthread_cond_timedwait, as alarm_cond.c does (the
+ *              default)
+ *   timerfd    poll on a high-resolution timerfd, for deadlines
+ *              where a condition wait's wake-up jitter matters
+ *
+ * and "spin" (ns, 0 for none) is how far from its wake time the
+ * thread stops sleeping and spins instead, trading a CPU for
+ * accuracy on latency-critical shards. Returns -1 if the strategy
+ * or shard is unknown.
+ */
+extern int alarm_sched_wait (alarm_sched_t *sched, int shard, const char *strategy,
+    alarm_time_t spin);
+
+extern void alarm_sched_start (alarm_sched_t *sched);
+
+/*
+ * What this build of the scheduler has compiled in -- "all queue
+ * backends" or the one it has, and any of "no group index", "no
+ * pool" and "stats" -- for a benchmark to print with its results.
+ */
+extern const char *alarm_sched_build (void);
+
+/*
+ * Stop the expiry threads, once they have answered every request
+ * already submitted, and free the scheduler. Alarms still pending
+ * are freed, and their messages released, without being reported
+ * or delivered. Nothing may submit to the scheduler once this has
+ * been called.
+ */
+extern void alarm_sched_destroy (alarm_sched_t *sched);
+
+/*
+ * Limit the alarms pending at once: "alarms" in all, "group" in any
+ * one group and "bytes" of memory between them (see alarm_admit.h);
+ * 0 is no limit. Call this before anything is admitted.
+ */
+extern void alarm_sched_limit (alarm_sched_t *sched, long alarms, int group,
+    unsigned long bytes);
+
+/*
+ * Admit a new alarm (with its group_id and message set) against the
+ * limits, as "how" (ALARM_ADMIT_TRY, _WAIT or _FORCE) says. Returns
+ * 0 if it was admitted, or the ALARM_LIMIT_ that refused it, in
+ * which case the alarm is still the caller's. Every new alarm must
+ * be admitted before it is submitted; the scheduler gives its share
+ * back when it expires, is cancelled or turns out to be a duplicate.
+ */
+extern int alarm_admit (alarm_sched_t *sched, alarm_t *alarm, int how);
+
+/*
+ * What the admitted alarms take up, and their peaks.
+ */
+extern void alarm_sched_usage (alarm_sched_t *sched, alarm_usage_t *usage);
+
+/*
+ * Schedule a new alarm (from alarm_alloc) whose time must already
+ * be set and which alarm_admit has admitted. The scheduler owns the
+ * alarm from here on; if its
+ * alarm_id turns out to be pending already, it is reported as
+ * ALARM_EXISTS and freed.
+ *
+ * An alarm with "periodic" set and a non-zero duration stays
+ * pending until it is cancelled: each time it expires, it is queued
+ * again for its previous deadline plus its duration (skipping any
+ * periods already missed), so its firings don't drift, and a copy
+ * sharing its message is delivered in its place. Each firing so
+ * allocates one alarm_t (from the expiry thread's pool cache, so
+ * normally without a lock) and takes a hold on the message, both
+ * given back once the copy is delivered; the pending alarm itself
+ * never leaves the queue, so a cancel or change racing a delivery
+ * always finds it.
+ */
+extern void alarm_submit (alarm_sched_t *sched, alarm_t *alarm);
+
+/*
+ * Schedule a chain of new alarms (through alarm_t.link), as if each
+ * were given to alarm_submit in chain order with "request" (ALARM_START
+ * or ALARM_RESTORE) in alarm_t.request, but touching each shard
+ * once: its part of the chain goes onto the intake with a single
+ * compare-and-swap and the shard is signaled at most once. The
+ * expiry thread then puts the new alarms on its queue in one
+ * alarm_queue_insert_batch.
+ */
+extern void alarm_submit_batch (alarm_sched_t *sched, alarm_t *batch, int request);
+
+/*
+ * Give a pending alarm a new group, duration (counted from now)
+ * and message, moving it in its queue. The scheduler takes over
+ * "message" and releases the old one. The outcome is reported as
+ * ALARM_CHANGED or ALARM_NOT_FOUND, with "client" in the carrier.
+ */
+extern void alarm_change (alarm_sched_t *sched, int alarm_id, int group_id,
+    alarm_time_t duration, alarm_message_t message, int client);
+
+/*
+ * Take a pending alarm, or every pending alarm in a group, off the
+ * queues, re-arming any expiry thread that was waiting for one of
+ * them. An alarm is found through the alarm_id index, and a group's
+ * alarms through each shard's group index, and removed from the
+ * queue directly (O(1) on the list and wheel, O(log n) on the
+ * heap), so only the alarms cancelled are touched. The outcome is reported as ALARM_CANCELLED (or
+ * ALARM_NOT_FOUND for an alarm_id not pending), with "client" in
+ * the carrier; a group cancel is reported once, when every shard
+ * has removed its part of the group.
+ */
+extern void alarm_cancel (alarm_sched_t *sched, int alarm_id, int client);
+extern void alarm_cancel_group (alarm_sched_t *sched, int group_id, int client);
+
+/*
+ * List every pending alarm, or those in a group. Each shard copies
+ * its part onto the listing when it takes the request off its
+ * intake -- a consistent view of that shard, after every request
+ * submitted before it -- and the copies share the alarms' messages,
+ * so a shard is held up only for the copying, never for formatting
+ * or output. The outcome is reported once, as ALARM_LISTED, when
+ * every shard has added its part; the snapshot is in no particular
+ * order.
+ */
+extern void alarm_list (alarm_sched_t *sched, int client);
+extern void alarm_list_group (alarm_sched_t *sched, int group_id, int client);
+
+#endif
@@ -0,0 +1,397 @@
+/*
+ * alarm_sched_bench.c
+ *
+ * Load generator for the scheduler in alarm_sched.c. Where
+ * alarm_queue_bench drives a bare queue, this runs the whole
+ * scheduler -- intake, shards, expiry threads and delivery -- in
+ * real time, with no stdin, parser or output stage in the way.
+ *
+ * "producers" threads submit "count" alarms between them, with
+ * deadlines spread over "span" from the moment each is submitted:
+ * uniformly, skewed towards the start of the span (as short
+ * timeouts are), or in bursts that fall due together. After each
+ * submit a producer may also change or cancel one of the alarms it
+ * started before, as given by the mix. The run ends when every
+ * alarm has expired or been cancelled, and reports submits per
+ * second, expiries per second (from the first expiry to the last,
+ * which for bursts is as fast as the shards can go), how late the
+ * alarms fired and the peak resident set size.
+ *
+ * Each run uses one backend and shard count; run it once for each
+ * to compare them on the same workload (the deadlines come from a
+ * fixed seed). The header also names what the scheduler was built
+ * with, so runs of specialized builds (see alarm_queue.h and
+ * alarm_group.h) can be told apart and compared the same way.
+ *
+ * usage: alarm_sched_bench [-q list|heap|wheel] [-s shards] [-n count]
+ *            [-p producers] [-w uniform|skewed|bursty] [-S span]
+ *            [-m change:cancel] [-t slack] [-a cond|timerfd[:spin]]
+ *            [-L limit]
+ *
+ * With a limit, at most that many alarms are pending at once and
+ * producers wait for room, so the run shows the cost of
+ * backpressure.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "errors.h"
+#include "alarm_sched.h"
+#include "alarm_pool.h"
+#include "alarm_message.h"
+#include "alarm_parse.h"
+
+#define BURSTS          20              /* bursts over the span */
+#define BURST_WIDTH     ALARM_NSEC_PER_MSEC
+
+/*
+ * Lateness histogram: 8 buckets between each power of two and the
+ * next, which is close enough for percentiles; the expiry threads
+ * count into it with atomic adds.
+ */
+#define LATE_SUB_BITS   3
+#define LATE_SUB        (1 << LATE_SUB_BITS)
+#define LATE_BUCKETS    ((64 - LATE_SUB_BITS) * LATE_SUB)
+
+static atomic_ulong late_buckets[LATE_BUCKETS];
+static atomic_llong late_max;
+
+static atomic_long started, removed, expired, outcomes;
+static atomic_llong first_expiry = LLONG_MAX, last_expiry;
+
+typedef struct producer_tag {
+    pthread_t           thread;
+    int                 index;
+} producer_t;
+
+static int count = 100000, producers = 1, change_pct = 0, cancel_pct = 0;
+static alarm_time_t *times;
+static alarm_sched_t *sched;
+static atomic_long requests;
+
+static double elapsed (struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime (CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start -> tv_sec)
+        + (end.tv_nsec - start -> tv_nsec) / 1e9;
+}
+
+static int late_bucket (unsigned long long value)
+{
+    int bits;
+
+    if (value < LATE_SUB) {
+        return (int) value;
+    }
+    bits = 63 - __builtin_clzll (value);
+    return (bits - LATE_SUB_BITS + 1) * LATE_SUB
+        + (int) ((value >> (bits - LATE_SUB_BITS)) & (LATE_SUB - 1));
+}
+
+static unsigned long long late_bucket_top (int bucket)
+{
+    int bits = bucket / LATE_SUB + LATE_SUB_BITS - 1;
+
+    if (bucket < LATE_SUB) {
+        return bucket;
+    }
+    return ((unsigned long long) (LATE_SUB + bucket % LATE_SUB + 1) << (bits - LATE_SUB_BITS)) - 1;
+}
+
+/*
+ * The lateness below which "fraction" of the expiries fall.
+ */
+static double late_percentile (double fraction)
+{
+    unsigned long rank = (unsigned long) (fraction * atomic_load (&expired)), seen = 0;
+    unsigned long long top;
+    int bucket;
+
+    for (bucket = 0; bucket < LATE_BUCKETS; bucket++) {
+        seen += atomic_load (&late_buckets[bucket]);
+        if (seen > rank) {
+            top = late_bucket_top (bucket);
+            if (top > (unsigned long long) atomic_load (&late_max)) {
+                top = atomic_load (&late_max);
+            }
+            return top / 1e3;
+        }
+    }
+    return atomic_load (&late_max) / 1e3;
+}
+
+/*
+ * Delivery: note how late each alarm is and free it.
+ */
+static void bench_deliver (alarm_t *batch, void *arg)
+{
+    alarm_time_t now = alarm_now (), late, max;
+    alarm_t *alarm;
+    long delivered = 0;
+
+    while (batch != NULL) {
+        alarm = batch;
+        batch = alarm -> link;
+        late = now - alarm -> time;
+        if (late < 0) {
+            late = 0;
+        }
+        atomic_fetch_add_explicit (&late_buckets[late_bucket (late)], 1, memory_order_relaxed);
+        max = atomic_load_explicit (&late_max, memory_order_relaxed);
+        while (late > max
+            && !atomic_compare_exchange_weak (&late_max, &max, late)) {
+            // max now holds the latest maximum
+        }
+        alarm_message_release (alarm -> message);
+        alarm_free (alarm);
+        delivered++;
+    }
+
+    max = atomic_load (&first_expiry);
+    while (now < max && !atomic_compare_exchange_weak (&first_expiry, &max, now)) {
+        // max now holds the latest first expiry
+    }
+    max = atomic_load (&last_expiry);
+    while (now > max && !atomic_compare_exchange_weak (&last_expiry, &max, now)) {
+        // max now holds the latest last expiry
+    }
+    atomic_fetch_add (&expired, delivered);
+}
+
+/*
+ * Outcomes: only counted, so that the run knows when it is over.
+ */
+static void bench_report (alarm_t *alarm, int result, void *arg)
+{
+    switch (result) {
+    case ALARM_STARTED:
+        atomic_fetch_add_explicit (&started, 1, memory_order_relaxed);
+        break;
+    case ALARM_REMOVED:
+        atomic_fetch_add_explicit (&removed, 1, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit (&outcomes, 1, memory_order_relaxed);
+}
+
+/*
+ * Producer thread start routine: submit alarms index, index +
+ * producers, ..., each followed by the mix of changes and cancels
+ * on alarms this thread has already submitted.
+ */
+static void *bench_producer (void *arg)
+{
+    producer_t *producer = arg;
+    unsigned int seed = producer -> index + 1;
+    long submitted = 0;
+    int index, mine = 0, target, roll;
+    alarm_t *alarm;
+
+    for (index = producer -> index; index < count; index += producers) {
+        alarm = alarm_alloc ();
+        alarm -> alarm_id = index + 1;
+        alarm -> group_id = index % 64;
+        alarm -> duration = times[index];
+        alarm -> time = alarm_now () + times[index];
+        alarm -> message = 0;
+        alarm -> client = 0;
+        alarm -> periodic = 0;
+        while (alarm_admit (sched, alarm, ALARM_ADMIT_WAIT) != 0) {
+            // Out of patience, but the run only measures waiting
+        }
+        alarm_submit (sched, alarm);
+        submitted++;
+        mine++;
+
+        roll = rand_r (&seed) % 100;
+        if (roll >= change_pct + cancel_pct) {
+            continue;
+        }
+        target = producer -> index + (rand_r (&seed) % mine) * producers;
+        if (roll < change_pct) {
+            alarm_change (sched, target + 1, target % 64,
+                times[rand_r (&seed) % count], 0, 0);
+        } else {
+            alarm_cancel (sched, target + 1, 0);
+        }
+        submitted++;
+    }
+    atomic_fetch_add (&requests, submitted);
+    return NULL;
+}
+
+/*
+ * Peak resident set size in kB, from /proc, or -1.
+ */
+static long peak_rss (void)
+{
+    char line[128];
+    long kb = -1;
+    FILE *status = fopen ("/proc/self/status", "r");
+
+    if (status == NULL) {
+        return -1;
+    }
+    while (fgets (line, sizeof (line), status) != NULL) {
+        if (sscanf (line, "VmHWM: %ld", &kb) == 1) {
+            break;
+        }
+    }
+    fclose (status);
+    return kb;
+}
+
+static double uniform (void)
+{
+    return (double) rand () / ((double) RAND_MAX + 1);
+}
+
+int main (int argc, char *argv[])
+{
+    const char *backend = ALARM_QUEUE_DEFAULT, *workload = "uniform", *wait = "cond", *colon;
+    char strategy[16];
+    long shards = sysconf (_SC_NPROCESSORS_ONLN);
+    alarm_time_t span = 2 * ALARM_NSEC_PER_SEC, slack = 0, spin = 0, burst;
+    alarm_usage_t usage;
+    long limit = 0;
+    struct timespec start, poll = { 0, ALARM_NSEC_PER_MSEC };
+    producer_t *threads;
+    double submit_secs, expire_secs;
+    int option, index, status;
+
+    while ((option = getopt (argc, argv, "q:s:n:p:w:S:m:t:a:L:")) != -1) {
+        switch (option) {
+        case 'q':
+            backend = optarg;
+            break;
+        case 's':
+            shards = atol (optarg);
+            break;
+        case 'n':
+            count = atoi (optarg);
+            break;
+        case 'p':
+            producers = atoi (optarg);
+            break;
+        case 'w':
+            workload = optarg;
+            break;
+        case 'S':
+            if (alarm_parse_duration (optarg, strlen (optarg), &span) != 0 || span <= 0) {
+                fprintf (stderr, "Bad span: %s\n", optarg);
+                exit (1);
+            }
+            break;
+        case 'm':
+            if (sscanf (optarg, "%d:%d", &change_pct, &cancel_pct) != 2
+                || change_pct < 0 || cancel_pct < 0 || change_pct + cancel_pct > 100) {
+                fprintf (stderr, "Bad mix: %s\n", optarg);
+                exit (1);
+            }
+            break;
+        case 't':
+            if (alarm_parse_duration (optarg, strlen (optarg), &slack) != 0) {
+                fprintf (stderr, "Bad timer slack: %s\n", optarg);
+                exit (1);
+            }
+            break;
+        case 'a':
+            wait = optarg;
+            break;
+        case 'L':
+            limit = atol (optarg);
+            break;
+        default:
+            count = 0;
+            break;
+        }
+    }
+    if (count <= 0 || producers <= 0 || shards <= 0) {
+        fprintf (stderr, "usage: %s [-q list|heap|wheel] [-s shards] [-n count]\n"
+            "           [-p producers] [-w uniform|skewed|bursty] [-S span]\n"
+            "           [-m change:cancel] [-t slack] [-a cond|timerfd[:spin]]\n"
+            "           [-L limit]\n", argv[0]);
+        exit (1);
+    }
+
+    times = malloc (count * sizeof (alarm_time_t));
+    threads = calloc (producers, sizeof (producer_t));
+    if (times == NULL || threads == NULL) {
+        errno_abort ("Allocate workload");
+    }
+    srand (1);
+    for (index = 0; index < count; index++) {
+        if (strcmp (workload, "uniform") == 0) {
+            times[index] = (alarm_time_t) (uniform () * span);
+        } else if (strcmp (workload, "skewed") == 0) {
+            times[index] = (alarm_time_t) (uniform () * uniform () * uniform () * span);
+        } else if (strcmp (workload, "bursty") == 0) {
+            burst = span / BURSTS * (1 + rand () % BURSTS);
+            times[index] = burst - (alarm_time_t) (uniform () * BURST_WIDTH);
+        } else {
+            fprintf (stderr, "Unknown workload: %s\n", workload);
+            exit (1);
+        }
+    }
+
+    sched = alarm_sched_create ((int) shards, backend, slack, bench_deliver, bench_report, NULL);
+    if (sched == NULL) {
+        fprintf (stderr, "Unknown timer queue backend: %s\n", backend);
+        exit (1);
+    }
+
+    // "strategy:spin" spins out the last "spin" before each wake-up
+    colon = strchr (wait, ':');
+    snprintf (strategy, sizeof (strategy), "%.*s",
+        (int) (colon != NULL ? colon - wait : strlen (wait)), wait);
+    if ((colon != NULL && alarm_parse_duration (colon + 1, strlen (colon + 1), &spin) != 0)
+        || alarm_sched_wait (sched, -1, strategy, spin) != 0) {
+        fprintf (stderr, "Bad wait strategy: %s\n", wait);
+        exit (1);
+    }
+    alarm_sched_limit (sched, limit, 0, 0);
+    alarm_sched_start (sched);
+
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (index = 0; index < producers; index++) {
+        threads[index].index = index;
+        status = pthread_create (&threads[index].thread, NULL, bench_producer, &threads[index]);
+        if (status != 0) {
+            err_abort (status, "Create producer");
+        }
+    }
+    for (index = 0; index < producers; index++) {
+        status = pthread_join (threads[index].thread, NULL);
+        if (status != 0) {
+            err_abort (status, "Join producer");
+        }
+    }
+    submit_secs = elapsed (&start);
+
+    // Every request answered, and every started alarm gone
+    while (atomic_load (&outcomes) < atomic_load (&requests)
+        || atomic_load (&expired) + atomic_load (&removed) < atomic_load (&started)) {
+        nanosleep (&poll, NULL);
+    }
+    expire_secs = (atomic_load (&last_expiry) - atomic_load (&first_expiry)) / 1e9;
+
+    printf ("%s x%ld, %s wait, %d alarms, %d producers, %s over %.3fs, mix %d:%d\n",
+        backend, shards, wait, count, producers, workload, span / 1e9, change_pct, cancel_pct);
+    printf ("Built with %s\n", alarm_sched_build ());
+    printf ("%10s %10s %10s %10s %10s %10s %10s\n", "submit/s", "expire/s",
+        "p50 us", "p99 us", "p99.9 us", "max us", "RSS kB");
+    printf ("%10.0f %10.0f %10.1f %10.1f %10.1f %10.1f %10ld\n",
+        atomic_load (&requests) / submit_secs,
+        expire_secs > 0 ? atomic_load (&expired) / expire_secs : 0.0,
+        late_percentile (0.5), late_percentile (0.99), late_percentile (0.999),
+        atomic_load (&late_max) / 1e3, peak_rss ());
+    alarm_sched_usage (sched, &usage);
+    printf ("peak %ld alarms pending, %lu bytes; producers waited %lu times\n",
+        usage.peak_alarms, usage.peak_bytes, usage.waits);
+    alarm_sched_destroy (sched);
+    return 0;
+}
@@ -0,0 +1,339 @@
+/*
+ * alarm_sink.c
+ *
+ * A records sink writes at most PIPE_BUF bytes at a time, a whole
+ * number of records, so on a pipe or FIFO every write is atomic:
+ * records from different shards never interleave, and a write to a
+ * full non-blocking pipe fails outright instead of leaving half a
+ * record behind. On a socket, which may take part of a record, the
+ * rest is kept in the sink and written ahead of the next batch, so
+ * the stream stays whole without the shard ever waiting for the
+ * reader; the sink's mutex keeps shards' writes from interleaving
+ * with a tail still to go.
+ *
+ * An eventfd sink keeps its records in a ring under the sink's
+ * mutex; the eventfd counts records queued but not yet read, so a
+ * consumer woken by it knows there is something to drain.
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "errors.h"
+#include "alarm_sink.h"
+#include "alarm_pool.h"
+
+#define SINK_CALLBACK   0
+#define SINK_RECORDS    1
+#define SINK_EVENTFD    2
+#define SINK_TEXT       3
+
+#define SINK_CHUNK      (PIPE_BUF / sizeof (alarm_record_t))
+
+struct alarm_sink_tag {
+    struct alarm_sink_tag *link;        /* next in the chain */
+    int                 kind;
+    alarm_sink_fn_t     fn;             /* callback */
+    void                *arg;
+    int                 fd;             /* records, text; eventfd's own */
+    pthread_mutex_t     mutex;          /* eventfd ring; records writes */
+    char                tail[sizeof (alarm_record_t)];
+    size_t              tail_length;    /* of a record cut short, at its end */
+    alarm_record_t      *ring;
+    int                 capacity;
+    int                 head;           /* oldest queued */
+    int                 count;
+    atomic_ulong        records;
+    atomic_ulong        dropped;
+};
+
+static alarm_sink_t *sink_create (int kind)
+{
+    alarm_sink_t *sink = (alarm_sink_t*)calloc (1, sizeof (alarm_sink_t));
+    int status;
+
+    if (sink == NULL) {
+        errno_abort ("Allocate sink");
+    }
+    sink -> kind = kind;
+    sink -> fd = -1;
+    status = pthread_mutex_init (&sink -> mutex, NULL);
+    if (status != 0) {
+        err_abort (status, "Init mutex");
+    }
+    return sink;
+}
+
+alarm_sink_t *alarm_sink_callback (alarm_sink_fn_t fn, void *arg)
+{
+    alarm_sink_t *sink = sink_create (SINK_CALLBACK);
+
+    sink -> fn = fn;
+    sink -> arg = arg;
+    return sink;
+}
+
+alarm_sink_t *alarm_sink_records (int fd)
+{
+    alarm_sink_t *sink = sink_create (SINK_RECORDS);
+
+    sink -> fd = fd;
+    return sink;
+}
+
+alarm_sink_t *alarm_sink_text (int fd)
+{
+    alarm_sink_t *sink = sink_create (SINK_TEXT);
+
+    sink -> fd = fd;
+    return sink;
+}
+
+alarm_sink_t *alarm_sink_eventfd (int capacity)
+{
+    alarm_sink_t *sink = sink_create (SINK_EVENTFD);
+
+    sink -> fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sink -> fd < 0) {
+        errno_abort ("Create eventfd");
+    }
+    sink -> capacity = capacity;
+    sink -> ring = (alarm_record_t*)malloc (capacity * sizeof (alarm_record_t));
+    if (sink -> ring == NULL) {
+        errno_abort ("Allocate sink ring");
+    }
+    return sink;
+}
+
+int alarm_sink_eventfd_fd (alarm_sink_t *sink)
+{
+    return sink -> fd;
+}
+
+void alarm_sink_add (alarm_sink_t *sink, alarm_sink_t *next)
+{
+    while (sink -> link != NULL) {
+        sink = sink -> link;
+    }
+    sink -> link = next;
+}
+
+void alarm_sink_counts (alarm_sink_t *sink, unsigned long *records, unsigned long *dropped)
+{
+    *records = atomic_load (&sink -> records);
+    *dropped = atomic_load (&sink -> dropped);
+}
+
+void alarm_format_duration (alarm_time_t duration, char *buffer, size_t size)
+{
+    if (duration % ALARM_NSEC_PER_SEC == 0) {
+        snprintf (buffer, size, "%lld", duration / ALARM_NSEC_PER_SEC);
+    } else {
+        snprintf (buffer, size, "%lld.%03lld", duration / ALARM_NSEC_PER_SEC,
+            duration % ALARM_NSEC_PER_SEC / ALARM_NSEC_PER_MSEC);
+    }
+}
+
+/*
+ * Write "count" records, as described above. Returns how many were
+ * written, counting one cut short, whose tail the next write
+ * finishes; the rest are dropped, as is everything while an earlier
+ * tail can't be finished.
+ */
+static int sink_write (alarm_sink_t *sink, alarm_record_t *records, int count)
+{
+    size_t length = count * sizeof (alarm_record_t), done = 0, part;
+    ssize_t written;
+    int status;
+
+    status = pthread_mutex_lock (&sink -> mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    while (sink -> tail_length > 0) {
+        written = write (sink -> fd, sink -> tail + sizeof (sink -> tail) - sink -> tail_length,
+            sink -> tail_length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            length = 0;
+            break;
+        }
+        sink -> tail_length -= written;
+    }
+    while (done < length) {
+        written = write (sink -> fd, (char*) records + done, length - done);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        done += written;
+    }
+
+    // Not a pipe: keep the rest of the record we are part way through
+    part = done % sizeof (alarm_record_t);
+    if (part != 0) {
+        sink -> tail_length = sizeof (alarm_record_t) - part;
+        memcpy (sink -> tail + part, (char*) records + done, sink -> tail_length);
+        done += sink -> tail_length;
+    }
+    status = pthread_mutex_unlock (&sink -> mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    return (int) (done / sizeof (alarm_record_t));
+}
+
+/*
+ * Queue "count" records on an eventfd sink's ring, and bump the
+ * eventfd by the number queued.
+ */
+static int sink_queue (alarm_sink_t *sink, alarm_record_t *records, int count)
+{
+    uint64_t added;
+    int index, status;
+
+    status = pthread_mutex_lock (&sink -> mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    for (index = 0; index < count && sink -> count < sink -> capacity; index++) {
+        sink -> ring[(sink -> head + sink -> count++) % sink -> capacity] = records[index];
+    }
+    status = pthread_mutex_unlock (&sink -> mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    added = index;
+    if (added > 0 && write (sink -> fd, &added, sizeof (added)) != sizeof (added)) {
+        errno_abort ("Signal eventfd");
+    }
+    return index;
+}
+
+int alarm_sink_read (alarm_sink_t *sink, alarm_record_t *records, int max)
+{
+    uint64_t pending;
+    int taken = 0, status;
+
+    status = pthread_mutex_lock (&sink -> mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    while (taken < max && sink -> count > 0) {
+        records[taken++] = sink -> ring[sink -> head];
+        sink -> head = (sink -> head + 1) % sink -> capacity;
+        sink -> count--;
+    }
+
+    // Reset the eventfd, then re-arm it for anything left behind
+    if (read (sink -> fd, &pending, sizeof (pending)) == sizeof (pending) && sink -> count > 0) {
+        pending = sink -> count;
+        if (write (sink -> fd, &pending, sizeof (pending)) != sizeof (pending)) {
+            errno_abort ("Signal eventfd");
+        }
+    }
+    status = pthread_mutex_unlock (&sink -> mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    return taken;
+}
+
+/*
+ * Hand a batch to a records or eventfd sink SINK_CHUNK records at a
+ * time.
+ */
+static void sink_records (alarm_sink_t *sink, alarm_t *batch, alarm_time_t now)
+{
+    alarm_record_t records[SINK_CHUNK];
+    alarm_t *alarm = batch;
+    int count, kept;
+
+    while (alarm != NULL) {
+        for (count = 0; alarm != NULL && count < SINK_CHUNK; alarm = alarm -> link) {
+            records[count].alarm_id = alarm -> alarm_id;
+            records[count].group_id = alarm -> group_id;
+            records[count].time = alarm -> time;
+            records[count].fired = now;
+            records[count].duration = alarm -> duration;
+            count++;
+        }
+        if (sink -> kind == SINK_RECORDS) {
+            kept = sink_write (sink, records, count);
+        } else {
+            kept = sink_queue (sink, records, count);
+        }
+        atomic_fetch_add (&sink -> records, kept);
+        atomic_fetch_add (&sink -> dropped, count - kept);
+    }
+}
+
+/*
+ * Write a batch as text, gathering lines into a buffer with a
+ * write whenever it fills. The lines of a failed write are dropped.
+ */
+static void sink_text_flush (alarm_sink_t *sink, char *buffer, size_t used, int lines)
+{
+    if (write (sink -> fd, buffer, used) == (ssize_t) used) {
+        atomic_fetch_add (&sink -> records, lines);
+    } else {
+        atomic_fetch_add (&sink -> dropped, lines);
+    }
+}
+
+static void sink_text (alarm_sink_t *sink, alarm_t *batch)
+{
+    char buffer[4 * (ALARM_MESSAGE_MAX + 64)], duration[32];
+    size_t used = 0;
+    alarm_t *alarm;
+    int lines = 0;
+
+    for (alarm = batch; alarm != NULL; alarm = alarm -> link) {
+        if (used > sizeof (buffer) - (ALARM_MESSAGE_MAX + 64)) {
+            sink_text_flush (sink, buffer, used, lines);
+            used = 0;
+            lines = 0;
+        }
+        alarm_format_duration (alarm -> duration, duration, sizeof (duration));
+        used += snprintf (buffer + used, sizeof (buffer) - used, "(%s) %s\n",
+            duration, alarm_message_text (alarm -> message));
+        lines++;
+    }
+    if (used > 0) {
+        sink_text_flush (sink, buffer, used, lines);
+    }
+}
+
+void alarm_sink_deliver (alarm_t *batch, void *arg)
+{
+    alarm_time_t now = alarm_now ();
+    alarm_sink_t *sink;
+    alarm_t *alarm;
+
+    for (sink = arg; sink != NULL; sink = sink -> link) {
+        switch (sink -> kind) {
+        case SINK_CALLBACK:
+            sink -> fn (batch, sink -> arg);
+            break;
+        case SINK_RECORDS:
+        case SINK_EVENTFD:
+            sink_records (sink, batch, now);
+            break;
+        case SINK_TEXT:
+            sink_text (sink, batch);
+            break;
+        }
+    }
+
+    while (batch != NULL) {
+        alarm = batch;
+        batch = alarm -> link;
+        alarm_message_release (alarm -> message);
+        alarm_free (alarm);
+    }
+}
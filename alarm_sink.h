@@ -0,0 +1,89 @@
+/*
+ * alarm_sink.h
+ *
+ * Delivery sinks: where a scheduler's expired alarms go. A sink,
+ * or a chain of them, is given to alarm_sched_create as the "arg"
+ * of alarm_sink_deliver, which hands each expired batch to every
+ * sink in the chain in turn and then frees the alarms. There are
+ * four kinds:
+ *
+ *   callback   an in-process routine sees the batch itself, with
+ *              no copying or formatting
+ *   records    fixed-size binary records, a batch at a time, are
+ *              written to a pipe, FIFO or socket
+ *   eventfd    the records are queued in-process and an eventfd
+ *              is bumped by their number, so a consumer can wait
+ *              for it in poll or epoll and drain the queue
+ *   text       "(duration) message" lines are written to a file
+ *              descriptor, as the alarm programs print them
+ *
+ * None of them takes a scheduler lock. Records and text are
+ * written on the shard's expiry thread, so a descriptor that may
+ * fill had better be non-blocking: a record write that would block
+ * is dropped (and counted) rather than holding up the shard.
+ */
+#ifndef __alarm_sink_h
+#define __alarm_sink_h
+
+#include "alarm_sched.h"
+
+/*
+ * One expired alarm, as written by a records sink or queued by an
+ * eventfd sink. Times are CLOCK_MONOTONIC ns, as alarm_now gives.
+ */
+typedef struct alarm_record_tag {
+    int                 alarm_id;
+    int                 group_id;
+    alarm_time_t        time;           /* deadline */
+    alarm_time_t        fired;          /* when it was delivered */
+    alarm_time_t        duration;
+} alarm_record_t;
+
+typedef struct alarm_sink_tag alarm_sink_t;
+
+/*
+ * A callback sink's routine: sees a chain (through alarm_t.link) of
+ * expired alarms, which it must treat as read-only and not keep;
+ * they are freed once every sink has seen them.
+ */
+typedef void (*alarm_sink_fn_t) (alarm_t *batch, void *arg);
+
+extern alarm_sink_t *alarm_sink_callback (alarm_sink_fn_t fn, void *arg);
+extern alarm_sink_t *alarm_sink_records (int fd);
+extern alarm_sink_t *alarm_sink_text (int fd);
+
+/*
+ * An eventfd sink holding up to "capacity" undrained records (more
+ * are dropped). alarm_sink_eventfd_fd gives the eventfd to wait on;
+ * alarm_sink_read takes up to "max" queued records, oldest first,
+ * returning how many it took.
+ */
+extern alarm_sink_t *alarm_sink_eventfd (int capacity);
+extern int alarm_sink_eventfd_fd (alarm_sink_t *sink);
+extern int alarm_sink_read (alarm_sink_t *sink, alarm_record_t *records, int max);
+
+/*
+ * Add "next" to the end of the chain that starts with "sink".
+ */
+extern void alarm_sink_add (alarm_sink_t *sink, alarm_sink_t *next);
+
+/*
+ * The delivery routine to give alarm_sched_create, with the first
+ * sink of the chain as its "arg".
+ */
+extern void alarm_sink_deliver (alarm_t *batch, void *arg);
+
+/*
+ * How many records a sink has written or queued, and how many it
+ * has dropped.
+ */
+extern void alarm_sink_counts (alarm_sink_t *sink, unsigned long *records,
+    unsigned long *dropped);
+
+/*
+ * Format a duration in seconds for display: whole seconds print as
+ * before ("5"), anything else with millisecond precision ("0.250").
+ */
+extern void alarm_format_duration (alarm_time_t duration, char *buffer, size_t size);
+
+#endif
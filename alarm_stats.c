@@ -0,0 +1,310 @@
+/*
+ * alarm_stats.c
+ *
+ * Each thread's record is allocated the first time the thread
+ * counts anything and linked onto stats_threads, where it stays
+ * after the thread exits so its counts are kept. Its histograms are
+ * allocated on first use too, since most threads only ever take one
+ * or two of the locks. A record has a single writer, its thread;
+ * counters are atomics updated with relaxed loads and stores, which
+ * cost no more than plain ones, so a reader merging them never sees
+ * a torn value.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include "errors.h"
+#include "alarm_stats.h"
+
+#ifdef ALARM_STATS
+
+#define STATS_SUB_BITS  4               /* 16 buckets per power of two */
+#define STATS_SUB       (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS  42              /* values up to 2^42 ns, over an hour */
+#define STATS_BUCKETS   ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB)
+
+typedef struct stats_histogram_tag {
+    atomic_ulong        count;
+    atomic_ullong       max;
+    atomic_ulong        buckets[STATS_BUCKETS];
+} stats_histogram_t;
+
+typedef struct stats_thread_tag {
+    struct stats_thread_tag *link;
+    _Atomic (stats_histogram_t *) lateness;
+    _Atomic (stats_histogram_t *) wait[ALARM_SITES];
+    _Atomic (stats_histogram_t *) hold[ALARM_SITES];
+    atomic_int          depth;          /* alarms queued, if a shard */
+    atomic_int          max_depth;
+    int                 shard;          /* has reported a depth */
+} stats_thread_t;
+
+static const char *stats_site_names[ALARM_SITES] = {
+    "shard (expiry)", "shard (push)", "group cancel", "group (notify)",
+    "group (display)", "journal", "alarm pool", "message arena"
+};
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static stats_thread_t *stats_threads = NULL;
+static __thread stats_thread_t *stats_self = NULL;
+
+static stats_thread_t *stats_thread (void)
+{
+    stats_thread_t *self = stats_self;
+    int status;
+
+    if (self != NULL) {
+        return self;
+    }
+    self = (stats_thread_t*)calloc (1, sizeof (stats_thread_t));
+    if (self == NULL) {
+        errno_abort ("Allocate stats");
+    }
+    status = pthread_mutex_lock (&stats_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    self -> link = stats_threads;
+    stats_threads = self;
+    status = pthread_mutex_unlock (&stats_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+    stats_self = self;
+    return self;
+}
+
+/*
+ * The bucket for a value: exact below STATS_SUB, then STATS_SUB
+ * buckets between each power of two and the next.
+ */
+static int stats_bucket (unsigned long long value)
+{
+    int bits;
+
+    if (value < STATS_SUB) {
+        return (int) value;
+    }
+    bits = 63 - __builtin_clzll (value);
+    if (bits >= STATS_MAX_BITS) {
+        return STATS_BUCKETS - 1;
+    }
+    return (bits - STATS_SUB_BITS + 1) * STATS_SUB
+        + (int) ((value >> (bits - STATS_SUB_BITS)) & (STATS_SUB - 1));
+}
+
+/*
+ * The largest value that falls in a bucket.
+ */
+static unsigned long long stats_bucket_top (int bucket)
+{
+    int bits = bucket / STATS_SUB + STATS_SUB_BITS - 1;
+
+    if (bucket < STATS_SUB) {
+        return bucket;
+    }
+    return ((unsigned long long) (STATS_SUB + bucket % STATS_SUB + 1) << (bits - STATS_SUB_BITS)) - 1;
+}
+
+static void stats_add (stats_histogram_t *_Atomic *slot, alarm_time_t value)
+{
+    stats_histogram_t *histogram = atomic_load_explicit (slot, memory_order_relaxed);
+    atomic_ulong *bucket;
+
+    if (histogram == NULL) {
+        histogram = (stats_histogram_t*)calloc (1, sizeof (stats_histogram_t));
+        if (histogram == NULL) {
+            errno_abort ("Allocate histogram");
+        }
+        atomic_store_explicit (slot, histogram, memory_order_release);
+    }
+    if (value < 0) {
+        value = 0;
+    }
+    bucket = &histogram -> buckets[stats_bucket (value)];
+    atomic_store_explicit (bucket,
+        atomic_load_explicit (bucket, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit (&histogram -> count,
+        atomic_load_explicit (&histogram -> count, memory_order_relaxed) + 1,
+        memory_order_relaxed);
+    if ((unsigned long long) value > atomic_load_explicit (&histogram -> max, memory_order_relaxed)) {
+        atomic_store_explicit (&histogram -> max, value, memory_order_relaxed);
+    }
+}
+
+void alarm_stats_wait (int site, alarm_time_t *timer)
+{
+    alarm_time_t now = alarm_now ();
+
+    stats_add (&stats_thread () -> wait[site], now - *timer);
+    *timer = now;
+}
+
+void alarm_stats_hold (int site, alarm_time_t timer)
+{
+    stats_add (&stats_thread () -> hold[site], alarm_now () - timer);
+}
+
+void alarm_stats_fired (alarm_t *alarm, alarm_time_t now)
+{
+    stats_add (&stats_thread () -> lateness, now - alarm -> time);
+}
+
+void alarm_stats_depth (int count)
+{
+    stats_thread_t *self = stats_thread ();
+
+    self -> shard = 1;
+    atomic_store_explicit (&self -> depth, count, memory_order_relaxed);
+    if (count > atomic_load_explicit (&self -> max_depth, memory_order_relaxed)) {
+        atomic_store_explicit (&self -> max_depth, count, memory_order_relaxed);
+    }
+}
+
+/*
+ * Add one thread's histogram into a merged one.
+ */
+static void stats_merge (stats_histogram_t *total, stats_histogram_t *_Atomic *slot)
+{
+    stats_histogram_t *histogram = atomic_load_explicit (slot, memory_order_acquire);
+    int bucket;
+
+    if (histogram == NULL) {
+        return;
+    }
+    total -> count += atomic_load_explicit (&histogram -> count, memory_order_relaxed);
+    if (atomic_load_explicit (&histogram -> max, memory_order_relaxed) > total -> max) {
+        total -> max = atomic_load_explicit (&histogram -> max, memory_order_relaxed);
+    }
+    for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        total -> buckets[bucket] += atomic_load_explicit (&histogram -> buckets[bucket],
+            memory_order_relaxed);
+    }
+}
+
+/*
+ * The value below which "fraction" of the counts fall (the top of
+ * the bucket holding it, but never more than the maximum seen).
+ */
+static unsigned long long stats_percentile (stats_histogram_t *histogram, double fraction)
+{
+    unsigned long rank = (unsigned long) (fraction * histogram -> count), seen = 0;
+    unsigned long long top;
+    int bucket;
+
+    for (bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += histogram -> buckets[bucket];
+        if (seen > rank) {
+            top = stats_bucket_top (bucket);
+            return top < histogram -> max ? top : histogram -> max;
+        }
+    }
+    return histogram -> max;
+}
+
+/*
+ * Format a time in the largest unit that keeps it above one.
+ */
+static void stats_time (unsigned long long ns, char *buffer, size_t size)
+{
+    if (ns < 1000) {
+        snprintf (buffer, size, "%lluns", ns);
+    } else if (ns < ALARM_NSEC_PER_MSEC) {
+        snprintf (buffer, size, "%.1fus", ns / 1e3);
+    } else if (ns < ALARM_NSEC_PER_SEC) {
+        snprintf (buffer, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf (buffer, size, "%.2fs", ns / 1e9);
+    }
+}
+
+/*
+ * Describe a merged histogram as "count, p50 .. p99.9, max".
+ */
+static void stats_describe (stats_histogram_t *histogram, char *buffer, size_t size)
+{
+    static const double fractions[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *names[] = { "p50", "p90", "p99", "p99.9" };
+    char value[32];
+    size_t used;
+    int index;
+
+    used = snprintf (buffer, size, "%lu", histogram -> count);
+    for (index = 0; index < 4 && used < size; index++) {
+        stats_time (stats_percentile (histogram, fractions[index]), value, sizeof (value));
+        used += snprintf (buffer + used, size - used, " %s %s", names[index], value);
+    }
+    if (used < size) {
+        stats_time (histogram -> max, value, sizeof (value));
+        snprintf (buffer + used, size - used, " max %s", value);
+    }
+}
+
+void alarm_stats_report (alarm_stats_line_t line, void *arg)
+{
+    stats_histogram_t *total;
+    stats_thread_t *thread, *threads;
+    char text[256], wait[128], hold[128];
+    long depth = 0;
+    int max_depth = 0, site, status;
+
+    total = (stats_histogram_t*)malloc (sizeof (stats_histogram_t));
+    if (total == NULL) {
+        errno_abort ("Allocate histogram");
+    }
+
+    // Records are only ever added at the head, so the list is safe to walk
+    status = pthread_mutex_lock (&stats_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    threads = stats_threads;
+    status = pthread_mutex_unlock (&stats_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+
+    memset (total, 0, sizeof (*total));
+    for (thread = threads; thread != NULL; thread = thread -> link) {
+        stats_merge (total, &thread -> lateness);
+        if (thread -> shard) {
+            depth += atomic_load_explicit (&thread -> depth, memory_order_relaxed);
+            if (atomic_load_explicit (&thread -> max_depth, memory_order_relaxed) > max_depth) {
+                max_depth = atomic_load_explicit (&thread -> max_depth, memory_order_relaxed);
+            }
+        }
+    }
+    stats_describe (total, wait, sizeof (wait));
+    snprintf (text, sizeof (text), "Lateness: %s", wait);
+    line (text, arg);
+    snprintf (text, sizeof (text), "Queued: %ld alarms (at most %d on one shard)", depth, max_depth);
+    line (text, arg);
+
+    for (site = 0; site < ALARM_SITES; site++) {
+        memset (total, 0, sizeof (*total));
+        for (thread = threads; thread != NULL; thread = thread -> link) {
+            stats_merge (total, &thread -> wait[site]);
+        }
+        if (total -> count == 0) {
+            continue;
+        }
+        stats_describe (total, wait, sizeof (wait));
+        memset (total, 0, sizeof (*total));
+        for (thread = threads; thread != NULL; thread = thread -> link) {
+            stats_merge (total, &thread -> hold[site]);
+        }
+        stats_describe (total, hold, sizeof (hold));
+        snprintf (text, sizeof (text), "Lock %s: wait %s", stats_site_names[site], wait);
+        line (text, arg);
+        snprintf (text, sizeof (text), "Lock %s: hold %s", stats_site_names[site], hold);
+        line (text, arg);
+    }
+    free (total);
+}
+
+#else
+
+void alarm_stats_report (alarm_stats_line_t line, void *arg)
+{
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * alarm_stats.h
+ *
+ * Scheduler instrumentation: how late alarms fire, how long each
+ * mutex is waited for and held at each place it is taken, and how
+ * many alarms are queued. Every thread counts into a record of its
+ * own, so recording takes no lock and shares no cache line; the
+ * records are merged only when they are read.
+ *
+ * Times go into HDR-style histograms: log-linear buckets, 16 to
+ * each power of two, so every value is kept to within about 6%
+ * over the whole range from nanoseconds to an hour.
+ *
+ * When compiled -DALARM_STATS, the STATS_ macros below record into
+ * the histograms. Otherwise they expand to nothing (as DPRINTF does
+ * without -DDEBUG) and alarm_stats_report reports nothing, so the
+ * instrumentation costs nothing unless it is asked for.
+ */
+#ifndef __alarm_stats_h
+#define __alarm_stats_h
+
+#include "alarm_queue.h"
+
+/*
+ * The places a mutex is taken.
+ */
+#define ALARM_SITE_EXPIRY       0       /* shard, by its expiry thread */
+#define ALARM_SITE_PUSH         1       /* shard, by a producer's signal */
+#define ALARM_SITE_CANCEL       2       /* group cancel totals */
+#define ALARM_SITE_NOTIFY       3       /* display queues, by a report */
+#define ALARM_SITE_DISPLAY      4       /* display queues, by a display */
+#define ALARM_SITE_JOURNAL      5       /* store batch, by an append */
+#define ALARM_SITE_POOL         6       /* alarm pool depot */
+#define ALARM_SITE_MESSAGE      7       /* message arena free lists */
+#define ALARM_SITES             8
+
+#ifdef ALARM_STATS
+
+/*
+ * Declare a timer: a local the other macros use to time one
+ * critical section.
+ */
+# define STATS_TIMER(timer)             alarm_time_t timer
+/*
+ * Start timing, just before asking for a lock.
+ */
+# define STATS_START(timer)             ((timer) = alarm_now ())
+/*
+ * The lock is held: record the wait and start timing the hold.
+ */
+# define STATS_WAIT(site, timer)        alarm_stats_wait ((site), &(timer))
+/*
+ * About to let go of the lock: record the hold.
+ */
+# define STATS_HOLD(site, timer)        alarm_stats_hold ((site), (timer))
+/*
+ * An alarm is fired at "now".
+ */
+# define STATS_FIRED(alarm, now)        alarm_stats_fired ((alarm), (now))
+/*
+ * The calling shard thread has "count" alarms queued.
+ */
+# define STATS_DEPTH(count)             alarm_stats_depth (count)
+
+extern void alarm_stats_wait (int site, alarm_time_t *timer);
+extern void alarm_stats_hold (int site, alarm_time_t timer);
+extern void alarm_stats_fired (alarm_t *alarm, alarm_time_t now);
+extern void alarm_stats_depth (int count);
+
+#else
+
+# define STATS_TIMER(timer)
+# define STATS_START(timer)
+# define STATS_WAIT(site, timer)
+# define STATS_HOLD(site, timer)
+# define STATS_FIRED(alarm, now)
+# define STATS_DEPTH(count)
+
+#endif
+
+/*
+ * Receives one line (without a newline) of a stats report.
+ */
+typedef void (*alarm_stats_line_t) (const char *line, void *arg);
+
+/*
+ * Merge every thread's record and pass the report to "line", one
+ * line at a time. Does nothing unless compiled -DALARM_STATS.
+ */
+extern void alarm_stats_report (alarm_stats_line_t line, void *arg);
+
+#endif
@@ -0,0 +1,1015 @@
+/*
+ * alarm_store.c
+ *
+ * Snapshot layout (native byte order; the store is not meant to
+ * move between machines):
+ *
+ *      store_header_t                  magic, version, counts
+ *      store_record_t[count]           one per alarm
+ *      char[text_size]                 messages, not terminated
+ *
+ * Each change log entry is a store_entry_t followed by its message
+ * text, if any. A crash can leave a torn entry at the end of the
+ * log; replay stops at the first entry that doesn't fit. A periodic
+ * alarm is started by a STORE_PERIODIC entry instead of STORE_START,
+ * and its snapshot record has STORE_RECORD_PERIODIC set in
+ * text_length, which older stores never come near; its firings are
+ * not logged, since its first deadline and period give its phase.
+ *
+ * The log is a write-ahead journal with group commit. Threads that
+ * record a change append it to an in-memory batch; a journal thread
+ * writes each batch with one write and makes it durable with one
+ * fdatasync, so the cost of a sync is shared by every change that
+ * arrived during the commit window (or during the previous sync).
+ * A reply confirming a change waits with the batch holding it, or
+ * with the batch being synced if nothing has been appended since,
+ * and is queued for output only once that batch is durable.
+ *
+ * While the store is being restored, the alarms are kept on a list
+ * (through link and prev) and in an alarm_index_t of their own, so
+ * log entries can be applied to them by alarm_id. Replaying a log
+ * over a snapshot that already includes it is harmless -- starts and
+ * changes overwrite, removes of missing alarms are ignored -- which
+ * is what makes it safe to replace the snapshot before emptying the
+ * log.
+ */
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_store.h"
+#include "alarm_stats.h"
+#include "alarm_sched.h"
+#include "alarm_index.h"
+#include "alarm_pool.h"
+#include "alarm_output.h"
+
+#ifndef NO_ALARM_STORE
+
+#define STORE_MAGIC     "ALRMSNAP"
+#define STORE_VERSION   1
+#define STORE_EXPIRED   128     /* remove entries per append */
+#define STORE_COMMIT    (1 << 20)       /* commit a batch this big at once */
+#define STORE_COMPACT   (16 << 20)      /* least log worth compacting */
+
+typedef struct store_header_tag {
+    char                magic[8];
+    unsigned int        version;
+    unsigned int        count;          /* records */
+    unsigned long long  text_size;      /* bytes of message text */
+} store_header_t;
+
+typedef struct store_record_tag {
+    long long           deadline;       /* CLOCK_REALTIME, ns */
+    long long           duration;       /* ns */
+    int                 alarm_id;
+    int                 group_id;
+    unsigned int        text_offset;
+    unsigned int        text_length;    /* and STORE_RECORD_PERIODIC */
+} store_record_t;
+
+#define STORE_RECORD_PERIODIC   0x80000000u
+
+/*
+ * Change log entry types.
+ */
+#define STORE_START     1
+#define STORE_CHANGE    2
+#define STORE_REMOVE    3
+#define STORE_PERIODIC  4       /* STORE_START, for a periodic alarm */
+
+typedef struct store_entry_tag {
+    unsigned int        type;
+    unsigned int        text_length;    /* bytes of text following */
+    int                 alarm_id;
+    int                 group_id;
+    long long           deadline;       /* CLOCK_REALTIME, ns */
+    long long           duration;
+} store_entry_t;
+
+/*
+ * Message text where it lies in a mapped snapshot or log.
+ */
+typedef struct store_text_tag {
+    const char          *text;
+    size_t              length;
+} store_text_t;
+
+/*
+ * The alarms being restored, or being compacted into a new
+ * snapshot. A compaction doesn't copy message text into the arena:
+ * each alarm's "message" is an index into "texts" instead, which
+ * point into the mapped files.
+ */
+typedef struct store_restore_tag {
+    alarm_index_t       index;
+    alarm_t             *list;
+    long                count;
+    int                 client;
+    int                 compact;        /* texts, not messages */
+    store_text_t        *texts;
+    unsigned int        text_count;
+    unsigned int        text_capacity;
+} store_restore_t;
+
+/*
+ * A growable byte buffer for journal batches.
+ */
+typedef struct store_buffer_tag {
+    char                *data;
+    size_t              used;
+    size_t              size;
+} store_buffer_t;
+
+/*
+ * A confirmation waiting for a commit, with a hold on its client.
+ */
+typedef struct store_reply_tag {
+    struct store_reply_tag *link;
+    int                 client;
+    char                text[];         /* sized to fit */
+} store_reply_t;
+
+typedef struct store_replies_tag {
+    store_reply_t       *first;
+    store_reply_t       **last;
+} store_replies_t;
+
+/*
+ * The mutex protects the pending batch, the replies and the
+ * counters. The
+ * journal thread waits on store_cond for a batch to fill or its
+ * window to pass; store_flush waits on store_done for a commit.
+ */
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t store_cond;       /* CLOCK_MONOTONIC */
+static pthread_cond_t store_done;       /* CLOCK_MONOTONIC */
+static store_buffer_t store_pending;    /* batch being collected */
+static unsigned long store_pending_entries;
+static alarm_time_t store_first;        /* first entry of the batch */
+static alarm_time_t store_window;       /* group commit window */
+static int store_committing;            /* a batch is being synced */
+static store_replies_t store_pending_replies = { NULL, &store_pending_replies.first };
+static store_replies_t store_synced_replies = { NULL, &store_synced_replies.first };
+static int store_flushing;              /* exiting: commit at once */
+static alarm_store_stats_t store_stats;
+static int store_log = -1;              /* change log, or -1 */
+static char store_path[PATH_MAX];       /* the snapshot */
+static char store_log_path[PATH_MAX];
+static size_t store_log_size;           /* bytes committed to the log */
+static size_t store_snapshot_size;
+static alarm_time_t store_offset;       /* CLOCK_REALTIME - alarm_now */
+
+static void store_buffer_grow (store_buffer_t *buffer, size_t size)
+{
+    size_t new_size = buffer -> size ? buffer -> size : STORE_COMMIT;
+    char *data;
+
+    while (new_size < size) {
+        new_size *= 2;
+    }
+    data = realloc (buffer -> data, new_size);
+    if (data == NULL) {
+        errno_abort ("Grow journal buffer");
+    }
+    buffer -> data = data;
+    buffer -> size = new_size;
+}
+
+static void store_buffer_swap (store_buffer_t *a, store_buffer_t *b)
+{
+    store_buffer_t swap = *a;
+
+    *a = *b;
+    *b = swap;
+}
+
+/*
+ * Map a whole file read-only. Returns NULL with "*size" 0 if the
+ * file is missing or empty, and aborts on any other failure.
+ */
+static const char *store_map (const char *path, size_t *size)
+{
+    struct stat info;
+    void *map;
+    int fd;
+
+    *size = 0;
+    fd = open (path, O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return NULL;
+        }
+        errno_abort ("Open store");
+    }
+    if (fstat (fd, &info) != 0) {
+        errno_abort ("Stat store");
+    }
+    if (info.st_size == 0) {
+        close (fd);
+        return NULL;
+    }
+    map = mmap (NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        errno_abort ("Map store");
+    }
+    close (fd);
+    *size = info.st_size;
+    return map;
+}
+
+/*
+ * Set an alarm being restored, creating it if it is new. A start
+ * ("create") also says whether the alarm is periodic; a change
+ * leaves that as it was.
+ */
+static void store_put (store_restore_t *restore, int create, int periodic, int alarm_id,
+    int group_id, long long deadline, long long duration, const char *text, size_t length)
+{
+    alarm_t *alarm = alarm_index_find (&restore -> index, alarm_id);
+
+    if (alarm == NULL) {
+        if (!create) {
+            return;
+        }
+        alarm = alarm_alloc ();
+        alarm -> alarm_id = alarm_id;
+        alarm -> client = restore -> client;
+        if (!restore -> compact) {
+            alarm_output_hold (restore -> client);
+        }
+        alarm_index_insert (&restore -> index, alarm);
+        alarm -> prev = NULL;
+        alarm -> link = restore -> list;
+        if (restore -> list != NULL) {
+            restore -> list -> prev = alarm;
+        }
+        restore -> list = alarm;
+        restore -> count++;
+    } else if (!restore -> compact) {
+        alarm_message_release (alarm -> message);
+    }
+    if (create) {
+        alarm -> periodic = periodic;
+    }
+    alarm -> group_id = group_id;
+    alarm -> time = deadline - store_offset;
+    alarm -> duration = duration;
+    // A restored alarm whose text finds the arena full keeps none
+    if (!restore -> compact) {
+        alarm -> message = alarm_message_store (text, length);
+        return;
+    }
+    if (restore -> text_count == restore -> text_capacity) {
+        restore -> text_capacity = restore -> text_capacity ? restore -> text_capacity * 2 : 1024;
+        restore -> texts = (store_text_t*)realloc (restore -> texts,
+            restore -> text_capacity * sizeof (store_text_t));
+        if (restore -> texts == NULL) {
+            errno_abort ("Allocate compaction texts");
+        }
+    }
+    restore -> texts[restore -> text_count].text = text;
+    restore -> texts[restore -> text_count].length = length;
+    alarm -> message = restore -> text_count++;
+}
+
+/*
+ * An alarm's message text, and its length.
+ */
+static const char *store_text (store_restore_t *restore, alarm_t *alarm, size_t *length)
+{
+    const char *text;
+
+    if (restore -> compact) {
+        *length = restore -> texts[alarm -> message].length;
+        return restore -> texts[alarm -> message].text;
+    }
+    text = alarm_message_text (alarm -> message);
+    *length = strlen (text);
+    return text;
+}
+
+/*
+ * Forget an alarm being restored, if there is one.
+ */
+static void store_drop (store_restore_t *restore, int alarm_id)
+{
+    alarm_t *alarm = alarm_index_find (&restore -> index, alarm_id);
+
+    if (alarm == NULL) {
+        return;
+    }
+    if (alarm -> prev != NULL) {
+        alarm -> prev -> link = alarm -> link;
+    } else {
+        restore -> list = alarm -> link;
+    }
+    if (alarm -> link != NULL) {
+        alarm -> link -> prev = alarm -> prev;
+    }
+    alarm_index_remove (&restore -> index, alarm);
+    if (!restore -> compact) {
+        alarm_message_release (alarm -> message);
+        alarm_output_release (alarm -> client);
+    }
+    alarm_free (alarm);
+    restore -> count--;
+}
+
+/*
+ * Forget every alarm being restored, when the store can't be opened
+ * after all, or once a compaction is done with them.
+ */
+static void store_discard (store_restore_t *restore)
+{
+    alarm_t *alarm, *next;
+
+    for (alarm = restore -> list; alarm != NULL; alarm = next) {
+        next = alarm -> link;
+        if (!restore -> compact) {
+            alarm_message_release (alarm -> message);
+            alarm_output_release (alarm -> client);
+        }
+        alarm_free (alarm);
+    }
+    free (restore -> index.buckets);
+    free (restore -> texts);
+    memset (restore, 0, sizeof (*restore));
+}
+
+/*
+ * Turn a mapped snapshot's records into alarms. Returns -1 if it
+ * isn't a snapshot.
+ */
+static int store_load (store_restore_t *restore, const char *map, size_t size)
+{
+    const store_header_t *header = (const store_header_t *) map;
+    const store_record_t *records = (const store_record_t *) (header + 1);
+    const char *text;
+    unsigned int index, length;
+
+    if (size < sizeof (*header) || memcmp (header -> magic, STORE_MAGIC, 8) != 0
+        || header -> version != STORE_VERSION
+        || (size - sizeof (*header)) / sizeof (*records) < header -> count
+        || size - sizeof (*header) - header -> count * sizeof (*records) < header -> text_size) {
+        return -1;
+    }
+    text = (const char *) (records + header -> count);
+    for (index = 0; index < header -> count; index++) {
+        const store_record_t *record = &records[index];
+
+        length = record -> text_length & ~STORE_RECORD_PERIODIC;
+        if (record -> text_offset > header -> text_size
+            || length > header -> text_size - record -> text_offset) {
+            return -1;
+        }
+        store_put (restore, 1, (record -> text_length & STORE_RECORD_PERIODIC) != 0,
+            record -> alarm_id, record -> group_id, record -> deadline,
+            record -> duration, text + record -> text_offset, length);
+    }
+    return 0;
+}
+
+/*
+ * Apply a mapped change log, up to the first torn entry.
+ */
+static void store_replay (store_restore_t *restore, const char *map, size_t size)
+{
+    store_entry_t entry;
+    size_t offset = 0;
+
+    while (size - offset >= sizeof (entry)) {
+        memcpy (&entry, map + offset, sizeof (entry));
+        offset += sizeof (entry);
+        if (entry.text_length > size - offset) {
+            break;
+        }
+        switch (entry.type) {
+        case STORE_START:
+        case STORE_PERIODIC:
+        case STORE_CHANGE:
+            store_put (restore, entry.type != STORE_CHANGE, entry.type == STORE_PERIODIC,
+                entry.alarm_id, entry.group_id, entry.deadline, entry.duration,
+                map + offset, entry.text_length);
+            break;
+        case STORE_REMOVE:
+            store_drop (restore, entry.alarm_id);
+            break;
+        default:
+            return;
+        }
+        offset += entry.text_length;
+    }
+}
+
+/*
+ * Queue entries for the journal thread. "entries" is how many log
+ * entries the bytes hold, for the batch size counters. Appenders
+ * only copy into memory, so a shard thread never waits for the
+ * disk.
+ */
+static void store_append (const void *buffer, size_t length, int entries)
+{
+    int status;
+    STATS_TIMER (timer);
+
+    STATS_START (timer);
+    status = pthread_mutex_lock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    STATS_WAIT (ALARM_SITE_JOURNAL, timer);
+    if (store_pending.used + length > store_pending.size) {
+        store_buffer_grow (&store_pending, store_pending.used + length);
+    }
+    memcpy (store_pending.data + store_pending.used, buffer, length);
+    if (store_pending.used == 0) {
+        store_first = alarm_now ();
+    }
+    store_pending.used += length;
+    store_pending_entries += entries;
+
+    // Wake the journal thread for a new batch, or to commit a full one
+    if (store_pending.used == length || store_pending.used >= STORE_COMMIT) {
+        status = pthread_cond_signal (&store_cond);
+        if (status != 0) {
+            err_abort (status, "Signal cond");
+        }
+    }
+    STATS_HOLD (ALARM_SITE_JOURNAL, timer);
+    status = pthread_mutex_unlock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+/*
+ * Move one list of replies onto the end of another.
+ */
+static void store_replies_move (store_replies_t *to, store_replies_t *from)
+{
+    if (from -> first != NULL) {
+        *to -> last = from -> first;
+        to -> last = from -> last;
+        from -> first = NULL;
+        from -> last = &from -> first;
+    }
+}
+
+/*
+ * Queue the replies whose changes are now durable. The caller must
+ * have locked store_mutex; none of this blocks.
+ */
+static void store_replies_send (store_replies_t *replies)
+{
+    store_reply_t *reply, *next;
+
+    for (reply = replies -> first; reply != NULL; reply = next) {
+        next = reply -> link;
+        alarm_output_fd (reply -> client, "%s", reply -> text);
+        alarm_output_release (reply -> client);
+        free (reply);
+    }
+    replies -> first = NULL;
+    replies -> last = &replies -> first;
+}
+
+/*
+ * Write a batch and make it durable.
+ */
+static void store_commit (store_buffer_t *batch)
+{
+    const char *data = batch -> data;
+    size_t length = batch -> used;
+    ssize_t written;
+
+    while (length > 0) {
+        written = write (store_log, data, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errno_abort ("Write change log");
+        }
+        data += written;
+        length -= written;
+    }
+    if (fdatasync (store_log) != 0) {
+        errno_abort ("Sync change log");
+    }
+}
+
+static void store_compact (void);
+
+/*
+ * The journal thread's start routine: group commit. Once the first
+ * entry of a batch arrives, wait out the commit window (unless the
+ * batch fills up first), take the whole batch, and write and sync
+ * it unlocked while the next batch collects behind it.
+ */
+static void *store_thread (void *arg)
+{
+    store_buffer_t batch = { NULL, 0, 0 };
+    struct timespec cond_time;
+    alarm_time_t started, synced;
+    unsigned long entries;
+    int status;
+
+    status = pthread_mutex_lock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    while (1) {
+        while (store_pending.used == 0) {
+            status = pthread_cond_wait (&store_cond, &store_mutex);
+            if (status != 0) {
+                err_abort (status, "Wait on cond");
+            }
+        }
+        alarm_timespec (store_first + store_window, &cond_time);
+        while (store_pending.used < STORE_COMMIT && !store_flushing
+            && alarm_now () < store_first + store_window) {
+            status = pthread_cond_timedwait (&store_cond, &store_mutex, &cond_time);
+            if (status == ETIMEDOUT) {
+                break;
+            }
+            if (status != 0) {
+                err_abort (status, "Cond timedwait");
+            }
+        }
+
+        // Take the batch and its replies, leaving an empty buffer
+        batch.used = 0;
+        store_buffer_swap (&batch, &store_pending);
+        store_replies_move (&store_synced_replies, &store_pending_replies);
+        entries = store_pending_entries;
+        store_pending_entries = 0;
+        store_committing = 1;
+        status = pthread_mutex_unlock (&store_mutex);
+        if (status != 0) {
+            err_abort (status, "Unlock mutex");
+        }
+
+        started = alarm_now ();
+        store_commit (&batch);
+        synced = alarm_now ();
+
+        status = pthread_mutex_lock (&store_mutex);
+        if (status != 0) {
+            err_abort (status, "Lock mutex");
+        }
+        store_committing = 0;
+        store_replies_send (&store_synced_replies);
+        store_stats.commits++;
+        store_stats.entries += entries;
+        store_stats.bytes += batch.used;
+        if (entries > store_stats.max_batch) {
+            store_stats.max_batch = entries;
+        }
+        store_stats.sync_total += synced - started;
+        if (synced - started > store_stats.sync_max) {
+            store_stats.sync_max = synced - started;
+        }
+        status = pthread_cond_broadcast (&store_done);
+        if (status != 0) {
+            err_abort (status, "Broadcast cond");
+        }
+
+        /*
+         * Once the log outgrows the snapshot, fold it in. Changes
+         * keep collecting meanwhile; only their commit waits.
+         */
+        store_log_size += batch.used;
+        if (store_log_size >= STORE_COMPACT && store_log_size >= store_snapshot_size
+            && !store_flushing) {
+            store_committing = 1;
+            status = pthread_mutex_unlock (&store_mutex);
+            if (status != 0) {
+                err_abort (status, "Unlock mutex");
+            }
+            store_compact ();
+            status = pthread_mutex_lock (&store_mutex);
+            if (status != 0) {
+                err_abort (status, "Lock mutex");
+            }
+            store_committing = 0;
+            store_stats.compactions++;
+            status = pthread_cond_broadcast (&store_done);
+            if (status != 0) {
+                err_abort (status, "Broadcast cond");
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Commit whatever is still queued when the process exits, waiting
+ * at most a second for it.
+ */
+static void store_flush (void)
+{
+    struct timespec cond_time;
+    int status;
+
+    status = pthread_mutex_lock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    store_flushing = 1;
+    status = pthread_cond_signal (&store_cond);
+    if (status != 0) {
+        err_abort (status, "Signal cond");
+    }
+    alarm_timespec (alarm_now () + ALARM_NSEC_PER_SEC, &cond_time);
+    while (store_pending.used > 0 || store_committing) {
+        status = pthread_cond_timedwait (&store_done, &store_mutex, &cond_time);
+        if (status == ETIMEDOUT) {
+            break;
+        }
+        if (status != 0) {
+            err_abort (status, "Cond timedwait");
+        }
+    }
+    status = pthread_mutex_unlock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+/*
+ * Make a rename into the directory holding "path" durable.
+ */
+static int store_sync_dir (const char *path)
+{
+    char dir[PATH_MAX];
+    char *slash;
+    int fd, result;
+
+    snprintf (dir, sizeof (dir), "%s", path);
+    slash = strrchr (dir, '/');
+    if (slash == NULL) {
+        strcpy (dir, ".");
+    } else if (slash == dir) {
+        dir[1] = '\0';
+    } else {
+        *slash = '\0';
+    }
+    fd = open (dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return -1;
+    }
+    result = fsync (fd);
+    close (fd);
+    return result;
+}
+
+/*
+ * Write the restored alarms as a new snapshot and move it into
+ * place once it is safely on disk, then sync the directory, so that
+ * the rename -- and not just the file -- survives a crash before
+ * the log is emptied.
+ */
+static int store_snapshot (store_restore_t *restore, const char *path)
+{
+    char temp[PATH_MAX];
+    store_header_t header;
+    store_record_t record;
+    unsigned long long offset = 0;
+    const char *text;
+    size_t length;
+    alarm_t *alarm;
+    FILE *file;
+
+    snprintf (temp, sizeof (temp), "%s.tmp", path);
+    file = fopen (temp, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    setvbuf (file, NULL, _IOFBF, 1 << 20);
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, STORE_MAGIC, 8);
+    header.version = STORE_VERSION;
+    header.count = restore -> count;
+    for (alarm = restore -> list; alarm != NULL; alarm = alarm -> link) {
+        store_text (restore, alarm, &length);
+        header.text_size += length;
+    }
+    fwrite (&header, sizeof (header), 1, file);
+
+    for (alarm = restore -> list; alarm != NULL; alarm = alarm -> link) {
+        record.deadline = alarm -> time + store_offset;
+        record.duration = alarm -> duration;
+        record.alarm_id = alarm -> alarm_id;
+        record.group_id = alarm -> group_id;
+        record.text_offset = offset;
+        store_text (restore, alarm, &length);
+        record.text_length = length;
+        offset += record.text_length;
+        if (alarm -> periodic) {
+            record.text_length |= STORE_RECORD_PERIODIC;
+        }
+        fwrite (&record, sizeof (record), 1, file);
+    }
+    for (alarm = restore -> list; alarm != NULL; alarm = alarm -> link) {
+        text = store_text (restore, alarm, &length);
+        fwrite (text, 1, length, file);
+    }
+
+    if (fflush (file) != 0 || fsync (fileno (file)) != 0) {
+        fclose (file);
+        unlink (temp);
+        return -1;
+    }
+    if (fclose (file) != 0 || rename (temp, path) != 0) {
+        unlink (temp);
+        return -1;
+    }
+    return store_sync_dir (path);
+}
+
+/*
+ * Compact at runtime, on the journal thread, which is the only
+ * writer of either file: rebuild the pending alarms from the
+ * snapshot and the log as a restart would, write them as a new
+ * snapshot, and empty the log. A crash part way leaves either the
+ * old snapshot or the new one, with the log intact, and replaying
+ * it over either gives the same alarms.
+ */
+static void store_compact (void)
+{
+    store_restore_t restore;
+    const char *snapshot_map, *log_map;
+    size_t snapshot_size, log_size;
+    struct stat info;
+
+    memset (&restore, 0, sizeof (restore));
+    restore.client = -1;
+    restore.compact = 1;
+    snapshot_map = store_map (store_path, &snapshot_size);
+    if (snapshot_map != NULL && store_load (&restore, snapshot_map, snapshot_size) != 0) {
+        err_abort (EINVAL, "Load snapshot");
+    }
+    log_map = store_map (store_log_path, &log_size);
+    if (log_map != NULL) {
+        store_replay (&restore, log_map, log_size);
+    }
+    if (store_snapshot (&restore, store_path) != 0) {
+        errno_abort ("Write snapshot");
+    }
+    if (ftruncate (store_log, 0) != 0 || fdatasync (store_log) != 0) {
+        errno_abort ("Empty change log");
+    }
+    if (snapshot_map != NULL) {
+        munmap ((void *) snapshot_map, snapshot_size);
+    }
+    if (log_map != NULL) {
+        munmap ((void *) log_map, log_size);
+    }
+    store_discard (&restore);
+    store_log_size = 0;
+    if (stat (store_path, &info) == 0) {
+        store_snapshot_size = info.st_size;
+    }
+}
+
+long alarm_store_open (alarm_sched_t *sched, const char *path, int client,
+    alarm_time_t window)
+{
+    pthread_condattr_t cond_attr;
+    pthread_t thread;
+    int status;
+    char log_path[PATH_MAX];
+    store_restore_t restore;
+    struct timespec real;
+    struct stat info;
+    const char *map;
+    size_t size;
+    alarm_t *alarm;
+    long count;
+    int snapshot;
+
+    clock_gettime (CLOCK_REALTIME, &real);
+    store_offset = real.tv_sec * ALARM_NSEC_PER_SEC + real.tv_nsec - alarm_now ();
+    snprintf (log_path, sizeof (log_path), "%s.log", path);
+    memset (&restore, 0, sizeof (restore));
+    restore.client = client;
+
+    // The snapshot, then everything logged since it was written
+    map = store_map (path, &size);
+    if (map != NULL) {
+        status = store_load (&restore, map, size);
+        munmap ((void *) map, size);
+        if (status != 0) {
+            store_discard (&restore);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    snapshot = map != NULL;
+    map = store_map (log_path, &size);
+    if (map != NULL) {
+        store_replay (&restore, map, size);
+        munmap ((void *) map, size);
+    }
+
+    /*
+     * Compact: the new snapshot holds everything, so the log can
+     * start again empty. If the log is empty already, the snapshot
+     * we have is up to date.
+     */
+    if ((map != NULL || !snapshot) && store_snapshot (&restore, path) != 0) {
+        status = errno;
+        store_discard (&restore);
+        errno = status;
+        return -1;
+    }
+    store_log = open (log_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (store_log < 0) {
+        status = errno;
+        store_discard (&restore);
+        errno = status;
+        return -1;
+    }
+    snprintf (store_path, sizeof (store_path), "%s", path);
+    snprintf (store_log_path, sizeof (store_log_path), "%s", log_path);
+    if (stat (path, &info) == 0) {
+        store_snapshot_size = info.st_size;
+    }
+
+    // Start the journal thread, with its waits on the alarm clock
+    store_window = window;
+    status = pthread_condattr_init (&cond_attr);
+    if (status != 0) {
+        err_abort (status, "Init cond attr");
+    }
+    status = pthread_condattr_setclock (&cond_attr, CLOCK_MONOTONIC);
+    if (status != 0) {
+        err_abort (status, "Set cond clock");
+    }
+    status = pthread_cond_init (&store_cond, &cond_attr);
+    if (status == 0) {
+        status = pthread_cond_init (&store_done, &cond_attr);
+    }
+    if (status != 0) {
+        err_abort (status, "Init cond");
+    }
+    pthread_condattr_destroy (&cond_attr);
+    status = pthread_create (&thread, NULL, store_thread, NULL);
+    if (status != 0) {
+        err_abort (status, "Create journal thread");
+    }
+    status = pthread_detach (thread);
+    if (status != 0) {
+        err_abort (status, "Detach journal thread");
+    }
+    atexit (store_flush);
+    free (restore.index.buckets);
+
+    // Alarms already accepted once are restored whatever the limits
+    count = restore.count;
+    for (alarm = restore.list; alarm != NULL; alarm = alarm -> link) {
+        alarm_admit (sched, alarm, ALARM_ADMIT_FORCE);
+    }
+    alarm_submit_batch (sched, restore.list, ALARM_RESTORE);
+    return count;
+}
+
+void alarm_store_stats (alarm_store_stats_t *stats)
+{
+    int status;
+
+    status = pthread_mutex_lock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    *stats = store_stats;
+    status = pthread_mutex_unlock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+void alarm_store_reply (int client, const char *format, ...)
+{
+    char text[ALARM_OUTPUT_TEXT];
+    store_reply_t *reply;
+    va_list ap;
+    int status;
+
+    va_start (ap, format);
+    vsnprintf (text, sizeof (text), format, ap);
+    va_end (ap);
+    if (store_log < 0) {
+        alarm_output_fd (client, "%s", text);
+        return;
+    }
+    reply = (store_reply_t*)malloc (sizeof (store_reply_t) + strlen (text) + 1);
+    if (reply == NULL) {
+        errno_abort ("Allocate reply");
+    }
+    reply -> link = NULL;
+    reply -> client = client;
+    strcpy (reply -> text, text);
+
+    status = pthread_mutex_lock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+    if (store_pending.used > 0) {
+        alarm_output_hold (client);
+        *store_pending_replies.last = reply;
+        store_pending_replies.last = &reply -> link;
+    } else if (store_committing) {
+        alarm_output_hold (client);
+        *store_synced_replies.last = reply;
+        store_synced_replies.last = &reply -> link;
+    } else {
+        // Everything recorded so far is on disk already
+        alarm_output_fd (client, "%s", text);
+        free (reply);
+    }
+    status = pthread_mutex_unlock (&store_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+/*
+ * Log an alarm's current settings as a start or change entry.
+ */
+static void store_set (unsigned int type, alarm_t *alarm)
+{
+    char buffer[sizeof (store_entry_t) + ALARM_MESSAGE_MAX];
+    const char *text = alarm_message_text (alarm -> message);
+    store_entry_t entry;
+
+    entry.type = type;
+    entry.text_length = strlen (text);
+    entry.alarm_id = alarm -> alarm_id;
+    entry.group_id = alarm -> group_id;
+    entry.deadline = alarm -> time + store_offset;
+    entry.duration = alarm -> duration;
+    memcpy (buffer, &entry, sizeof (entry));
+    memcpy (buffer + sizeof (entry), text, entry.text_length);
+    store_append (buffer, sizeof (entry) + entry.text_length, 1);
+}
+
+void alarm_store_started (alarm_t *alarm)
+{
+    if (store_log >= 0) {
+        store_set (alarm -> periodic ? STORE_PERIODIC : STORE_START, alarm);
+    }
+}
+
+void alarm_store_changed (alarm_t *request)
+{
+    if (store_log >= 0) {
+        store_set (STORE_CHANGE, request);
+    }
+}
+
+void alarm_store_expired (alarm_t *batch)
+{
+    store_entry_t entries[STORE_EXPIRED];
+    int count = 0;
+
+    if (store_log < 0) {
+        return;
+    }
+    memset (entries, 0, sizeof (entries));
+    for (; batch != NULL; batch = batch -> link) {
+        // A periodic alarm's firing leaves it pending
+        if (batch -> periodic && batch -> duration > 0) {
+            continue;
+        }
+        entries[count].type = STORE_REMOVE;
+        entries[count].alarm_id = batch -> alarm_id;
+        if (++count == STORE_EXPIRED) {
+            store_append (entries, count * sizeof (entries[0]), count);
+            count = 0;
+        }
+    }
+    if (count > 0) {
+        store_append (entries, count * sizeof (entries[0]), count);
+    }
+}
+
+void alarm_store_removed (alarm_t *alarm)
+{
+    store_entry_t entry;
+
+    if (store_log >= 0) {
+        memset (&entry, 0, sizeof (entry));
+        entry.type = STORE_REMOVE;
+        entry.alarm_id = alarm -> alarm_id;
+        store_append (&entry, sizeof (entry), 1);
+    }
+}
+
+#endif
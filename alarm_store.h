@@ -0,0 +1,124 @@
+/*
+ * alarm_store.h
+ *
+ * Optional persistence for pending alarms, so that a restart does
+ * not lose them. The store is two files:
+ *
+ *      path            snapshot: a header, then one fixed-size
+ *                      record per alarm, then the message text
+ *      path.log        change log: an append-only sequence of
+ *                      binary entries (start, change, remove)
+ *                      made since the snapshot was written
+ *
+ * At startup the snapshot is mapped and its records turned straight
+ * into alarms, the log is replayed over them, and the survivors are
+ * written out as a new snapshot (emptying the log) before they are
+ * handed to the scheduler in one batch. No command text is parsed.
+ * The journal thread does the same while running, whenever the log
+ * has grown past 16MB and past the snapshot, so that neither file
+ * grows beyond what the pending alarms and their recent changes
+ * need.
+ *
+ * Changes are journaled with group commit: they are collected in
+ * memory and a journal thread writes and fdatasyncs each batch
+ * once, no later than the commit window after its first change.
+ * Replies confirming a change are held until the batch holding it
+ * is durable, so a crash loses only changes not yet confirmed, at
+ * most those of the last window.
+ *
+ * Deadlines are stored on the wall clock, since CLOCK_MONOTONIC
+ * restarts with the machine; an alarm whose deadline passed while
+ * the program was down expires as soon as it is restored. So does
+ * a periodic alarm, once, after which it keeps to the deadlines it
+ * would have had all along.
+ *
+ * Built with -DNO_ALARM_STORE, there is no store: the routines that
+ * record changes are empty inlines, so a program that never opens a
+ * store needn't pay even for the check, and alarm_store_open fails
+ * with ENOTSUP.
+ */
+#ifndef __alarm_store_h
+#define __alarm_store_h
+
+#include "alarm_sched.h"
+#include "alarm_output.h"
+
+/*
+ * Journal counters, since the store was opened.
+ */
+typedef struct alarm_store_stats_tag {
+    unsigned long       commits;        /* batches synced */
+    unsigned long       entries;        /* changes in them */
+    unsigned long       bytes;
+    unsigned long       max_batch;      /* most changes in one batch */
+    alarm_time_t        sync_total;     /* ns spent in write + fdatasync */
+    alarm_time_t        sync_max;
+    unsigned long       compactions;    /* log folded into the snapshot */
+} alarm_store_stats_t;
+
+#ifdef NO_ALARM_STORE
+
+#include <errno.h>
+#include <string.h>
+
+static inline long alarm_store_open (alarm_sched_t *sched, const char *path, int client,
+    alarm_time_t window)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+
+static inline void alarm_store_started (alarm_t *alarm) {}
+static inline void alarm_store_changed (alarm_t *request) {}
+static inline void alarm_store_expired (alarm_t *batch) {}
+static inline void alarm_store_removed (alarm_t *alarm) {}
+
+static inline void alarm_store_stats (alarm_store_stats_t *stats)
+{
+    memset (stats, 0, sizeof (*stats));
+}
+
+#define alarm_store_reply       alarm_output_fd
+
+#else
+
+/*
+ * Open (creating if need be) the store at "path", restore the
+ * alarms it holds and submit them to "sched" as ALARM_RESTORE
+ * requests, with "client" for their output. From then on the routines below
+ * record changes, committed at most "window" ns after they are
+ * made (0 commits as soon as the previous commit is done). Returns
+ * the number of alarms restored, or -1 with errno set if the store
+ * can't be opened or is not a store.
+ */
+extern long alarm_store_open (alarm_sched_t *sched, const char *path, int client,
+    alarm_time_t window);
+
+/*
+ * Record a started alarm, a change (given the change carrier), a
+ * chain of expired alarms, and an alarm removed by a cancel. They
+ * do nothing if the store is not open, and may be called from any
+ * thread.
+ */
+extern void alarm_store_started (alarm_t *alarm);
+extern void alarm_store_changed (alarm_t *request);
+extern void alarm_store_expired (alarm_t *batch);
+extern void alarm_store_removed (alarm_t *alarm);
+
+/*
+ * Copy the journal counters (all zero if the store is not open).
+ */
+extern void alarm_store_stats (alarm_store_stats_t *stats);
+
+/*
+ * Queue a printf-style confirmation for "client" once every change
+ * recorded so far is committed, so a client is never told of a
+ * change a crash could still lose; at once if the store is not
+ * open. Never blocks.
+ */
+extern void alarm_store_reply (int client, const char *format, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+#endif
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * alarm_workers.c
+ *
+ * A queue holds chunks: chains of alarms through alarm_t.link,
+ * themselves chained first alarm to first alarm through
+ * alarm_t.prev, which no queue backend needs once an alarm has
+ * expired. Each queue has its own mutex and condition variable, so
+ * an expiry thread dealing out a chunk contends only with the
+ * worker it is for and, rarely, a thief.
+ *
+ * Stealing is only worth it where a worker is backed up, so an
+ * expiry thread that hands a chunk to a busy worker also wakes an
+ * idle one, which comes looking. An idle worker that misses the
+ * chance simply sleeps until its own queue is given a chunk: work
+ * is never lost, only done with less help.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include "errors.h"
+#include "alarm_workers.h"
+
+#define WORK_CHUNK      16              /* alarms per chunk, unordered */
+
+typedef struct work_queue_tag {
+    pthread_mutex_t     mutex;
+    pthread_cond_t      cond;           /* chunk queued, or stopping */
+    alarm_t             *head;          /* oldest chunk */
+    alarm_t             **tail;
+    atomic_int          idle;           /* waiting on cond */
+    atomic_ulong        run;
+    atomic_ulong        stolen;
+    pthread_t           thread;
+    alarm_workers_t     *workers;
+} work_queue_t;
+
+struct alarm_workers_tag {
+    work_queue_t        *queues;
+    int                 count;
+    int                 ordered;
+    atomic_uint         next;           /* queue for the next chunk */
+    atomic_int          stopping;
+    alarm_deliver_t     deliver;
+    void                *arg;
+};
+
+static void work_lock (work_queue_t *queue)
+{
+    int status = pthread_mutex_lock (&queue -> mutex);
+
+    if (status != 0) {
+        err_abort (status, "Lock mutex");
+    }
+}
+
+static void work_unlock (work_queue_t *queue)
+{
+    int status = pthread_mutex_unlock (&queue -> mutex);
+
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
+}
+
+static void work_signal (work_queue_t *queue)
+{
+    int status = pthread_cond_signal (&queue -> cond);
+
+    if (status != 0) {
+        err_abort (status, "Signal cond");
+    }
+}
+
+/*
+ * Take the oldest chunk off a queue, or NULL. The caller must have
+ * locked the queue.
+ */
+static alarm_t *work_take (work_queue_t *queue)
+{
+    alarm_t *chunk = queue -> head;
+
+    if (chunk != NULL) {
+        queue -> head = chunk -> prev;
+        if (queue -> head == NULL) {
+            queue -> tail = &queue -> head;
+        }
+    }
+    return chunk;
+}
+
+/*
+ * Queue a chunk for a worker, waking it if it is idle -- or, if it
+ * is busy and others may steal, waking an idle worker instead.
+ */
+static void work_give (alarm_workers_t *workers, int index, alarm_t *chunk)
+{
+    work_queue_t *queue = &workers -> queues[index], *idle;
+    int busy, other;
+
+    chunk -> prev = NULL;
+    work_lock (queue);
+    *queue -> tail = chunk;
+    queue -> tail = &chunk -> prev;
+    busy = !atomic_load (&queue -> idle);
+    if (!busy) {
+        work_signal (queue);
+    }
+    work_unlock (queue);
+
+    if (busy && !workers -> ordered) {
+        for (other = 1; other < workers -> count; other++) {
+            idle = &workers -> queues[(index + other) % workers -> count];
+            if (atomic_load (&idle -> idle)) {
+                work_lock (idle);
+                if (atomic_load (&idle -> idle)) {
+                    work_signal (idle);
+                }
+                work_unlock (idle);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Look for a chunk on the other workers' queues, starting with the
+ * next one along.
+ */
+static alarm_t *work_steal (alarm_workers_t *workers, work_queue_t *self)
+{
+    int index = self - workers -> queues, other;
+    work_queue_t *victim;
+    alarm_t *chunk;
+
+    for (other = 1; other < workers -> count; other++) {
+        victim = &workers -> queues[(index + other) % workers -> count];
+
+        // An unlocked peek: at worst a chunk is missed or not there
+        if (victim -> head == NULL) {
+            continue;
+        }
+        work_lock (victim);
+        chunk = work_take (victim);
+        work_unlock (victim);
+        if (chunk != NULL) {
+            return chunk;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * A worker's start routine.
+ */
+static void *work_thread (void *arg)
+{
+    work_queue_t *queue = arg;
+    alarm_workers_t *workers = queue -> workers;
+    alarm_t *chunk, *alarm;
+    unsigned long count;
+    int stolen, status;
+
+    while (1) {
+        work_lock (queue);
+        chunk = work_take (queue);
+        work_unlock (queue);
+
+        stolen = 0;
+        if (chunk == NULL && !workers -> ordered) {
+            chunk = work_steal (workers, queue);
+            stolen = chunk != NULL;
+        }
+
+        if (chunk == NULL) {
+            /*
+             * Nothing anywhere: sleep until given a chunk, or poked
+             * to come and steal one. Stop only once the queue is
+             * empty, so everything given before the stop is run.
+             */
+            work_lock (queue);
+            if (queue -> head == NULL) {
+                if (atomic_load (&workers -> stopping)) {
+                    work_unlock (queue);
+                    return NULL;
+                }
+                atomic_store (&queue -> idle, 1);
+                status = pthread_cond_wait (&queue -> cond, &queue -> mutex);
+                if (status != 0) {
+                    err_abort (status, "Wait on cond");
+                }
+                atomic_store (&queue -> idle, 0);
+            }
+            work_unlock (queue);
+            continue;
+        }
+
+        // The chunk is the delivery routine's once it is handed over
+        for (count = 0, alarm = chunk; alarm != NULL; alarm = alarm -> link) {
+            count++;
+        }
+        workers -> deliver (chunk, workers -> arg);
+        atomic_fetch_add_explicit (&queue -> run, count, memory_order_relaxed);
+        if (stolen) {
+            atomic_fetch_add_explicit (&queue -> stolen, count, memory_order_relaxed);
+        }
+    }
+}
+
+alarm_workers_t *alarm_workers_create (int threads, int ordered,
+    alarm_deliver_t deliver, void *arg)
+{
+    alarm_workers_t *workers;
+    work_queue_t *queue;
+    int index, status;
+
+    if (threads > ALARM_WORKERS_MAX) {
+        threads = ALARM_WORKERS_MAX;
+    }
+    workers = (alarm_workers_t*)calloc (1, sizeof (alarm_workers_t));
+    if (workers == NULL) {
+        errno_abort ("Allocate workers");
+    }
+    workers -> queues = (work_queue_t*)calloc (threads, sizeof (work_queue_t));
+    if (workers -> queues == NULL) {
+        errno_abort ("Allocate work queues");
+    }
+    workers -> count = threads;
+    workers -> ordered = ordered;
+    workers -> deliver = deliver;
+    workers -> arg = arg;
+
+    for (index = 0; index < threads; index++) {
+        queue = &workers -> queues[index];
+        queue -> workers = workers;
+        queue -> tail = &queue -> head;
+        status = pthread_mutex_init (&queue -> mutex, NULL);
+        if (status != 0) {
+            err_abort (status, "Init mutex");
+        }
+        status = pthread_cond_init (&queue -> cond, NULL);
+        if (status != 0) {
+            err_abort (status, "Init cond");
+        }
+    }
+    for (index = 0; index < threads; index++) {
+        queue = &workers -> queues[index];
+        status = pthread_create (&queue -> thread, NULL, work_thread, queue);
+        if (status != 0) {
+            err_abort (status, "Create worker thread");
+        }
+    }
+    return workers;
+}
+
+/*
+ * Split the batch into chunks: runs of WORK_CHUNK alarms dealt out
+ * in turn, or, when ordered, one chunk per worker holding the
+ * alarms of the groups it owns, still in expiry order.
+ */
+void alarm_workers_deliver (alarm_t *batch, void *arg)
+{
+    alarm_workers_t *workers = arg;
+    alarm_t *first[ALARM_WORKERS_MAX], **last[ALARM_WORKERS_MAX];
+    alarm_t *alarm, *chunk;
+    int index, count;
+
+    if (workers -> ordered) {
+        for (index = 0; index < workers -> count; index++) {
+            first[index] = NULL;
+            last[index] = &first[index];
+        }
+        while (batch != NULL) {
+            alarm = batch;
+            batch = alarm -> link;
+            index = ((unsigned int) alarm -> group_id * 2654435769u >> 8)
+                % (unsigned int) workers -> count;
+            *last[index] = alarm;
+            last[index] = &alarm -> link;
+        }
+        for (index = 0; index < workers -> count; index++) {
+            if (first[index] != NULL) {
+                *last[index] = NULL;
+                work_give (workers, index, first[index]);
+            }
+        }
+        return;
+    }
+
+    while (batch != NULL) {
+        chunk = batch;
+        for (count = 1; count < WORK_CHUNK && batch -> link != NULL; count++) {
+            batch = batch -> link;
+        }
+        alarm = batch;
+        batch = alarm -> link;
+        alarm -> link = NULL;
+        work_give (workers, atomic_fetch_add (&workers -> next, 1) % workers -> count, chunk);
+    }
+}
+
+void alarm_workers_destroy (alarm_workers_t *workers)
+{
+    work_queue_t *queue;
+    int index, status;
+
+    atomic_store (&workers -> stopping, 1);
+    for (index = 0; index < workers -> count; index++) {
+        queue = &workers -> queues[index];
+        work_lock (queue);
+        work_signal (queue);
+        work_unlock (queue);
+    }
+    for (index = 0; index < workers -> count; index++) {
+        queue = &workers -> queues[index];
+        status = pthread_join (queue -> thread, NULL);
+        if (status != 0) {
+            err_abort (status, "Join worker thread");
+        }
+        pthread_mutex_destroy (&queue -> mutex);
+        pthread_cond_destroy (&queue -> cond);
+    }
+    free (workers -> queues);
+    free (workers);
+}
+
+void alarm_workers_counts (alarm_workers_t *workers, unsigned long *run, unsigned long *stolen)
+{
+    int index;
+
+    *run = *stolen = 0;
+    for (index = 0; index < workers -> count; index++) {
+        *run += atomic_load (&workers -> queues[index].run);
+        *stolen += atomic_load (&workers -> queues[index].stolen);
+    }
+}
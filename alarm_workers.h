@@ -0,0 +1,61 @@
+/*
+ * alarm_workers.h
+ *
+ * Worker threads that run expired alarms' actions off the expiry
+ * threads. Given to alarm_sched_create as its delivery routine, a
+ * worker pool only splits each expired batch into chunks and queues
+ * them, so however long the actions take, a shard is back to its
+ * queue at once and later deadlines aren't held up.
+ *
+ * Each worker has a queue of its own. The expiry threads deal the
+ * chunks out among the queues in turn, and a worker whose queue is
+ * empty steals the oldest chunk from another's, so one long action
+ * doesn't leave work waiting behind it while other workers sit
+ * idle.
+ *
+ * With per-group ordering, every alarm of a group goes to the same
+ * worker, chosen by group_id, and nothing is stolen, so a group's
+ * alarms run one at a time in the order they expired (alarms of
+ * different groups still run in parallel). Without it, alarms that
+ * expire close together may run in any order.
+ */
+#ifndef __alarm_workers_h
+#define __alarm_workers_h
+
+#include "alarm_sched.h"
+
+/*
+ * Upper limit on a pool's threads.
+ */
+#define ALARM_WORKERS_MAX       64
+
+typedef struct alarm_workers_tag alarm_workers_t;
+
+/*
+ * Start "threads" workers that pass each chunk to "deliver" (which
+ * owns the alarms, as a scheduler's delivery routine does) with
+ * "arg". "ordered" keeps each group's alarms in order.
+ */
+extern alarm_workers_t *alarm_workers_create (int threads, int ordered,
+    alarm_deliver_t deliver, void *arg);
+
+/*
+ * The delivery routine to give alarm_sched_create, with the pool as
+ * its "arg".
+ */
+extern void alarm_workers_deliver (alarm_t *batch, void *arg);
+
+/*
+ * Wait for the workers to run everything already queued, then stop
+ * them and free the pool. Its scheduler must have been destroyed.
+ */
+extern void alarm_workers_destroy (alarm_workers_t *workers);
+
+/*
+ * How many alarms the workers have run, and how many of those a
+ * worker stole from another's queue.
+ */
+extern void alarm_workers_counts (alarm_workers_t *workers, unsigned long *run,
+    unsigned long *stolen);
+
+#endif
@@ -12,272 +12,983 @@
  */
 #include <pthread.h>
 #include <time.h>
+#include <unistd.h>
 #include "errors.h"
+#include "alarm_sched.h"
+#include "alarm_output.h"
+#include "alarm_pool.h"
+#include "alarm_net.h"
+#include "alarm_parse.h"
+#include "alarm_store.h"
+#include "alarm_stats.h"
+#include "alarm_sink.h"
+#include "alarm_workers.h"
 // Added libraries (Arthi S.)
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Longest command line accepted, from the terminal or a client.
  */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    int                 seconds;
-    time_t              time;   /* seconds from EPOCH */
-    char                message[64];
-    int                 alarm_id;
+#define ALARM_LINE      (ALARM_MESSAGE_MAX + 128)
+
+/*
+ * The scheduler every command goes to, created by main, the binary
+ * records sink given by -e and the worker pool given by -W, if any.
+ */
+alarm_sched_t *alarm_scheduler;
+alarm_sink_t *alarm_records = NULL;
+alarm_workers_t *alarm_workers = NULL;
+
+/*
+ * New alarms refused for want of room.
+ */
+atomic_ulong alarm_rejected;
+
+/*
+ * How often to dump the stats, given by -d (0 for never). It is set
+ * once, before the dump thread starts, and lives as long as the
+ * thread does, which main's frame need not.
+ */
+alarm_time_t alarm_dump_interval = 0;
+
+/*
+ * Where errors for a client go: the terminal's to stderr, a network
+ * client's back down its connection.
+ */
+int alarm_error_fd (int client)
+{
+    return client == STDOUT_FILENO ? STDERR_FILENO : client;
+}
+
+/*
+ * Delivery sink for the scheduler: print each expired alarm for
+ * the client that set it. Runs with no lock held, on a shard's
+ * expiry thread or a worker; alarm_sink_deliver frees the alarms
+ * afterwards.
+ */
+void alarm_expired (alarm_t *batch, void *arg)
+{
+    alarm_t *alarm;
+    char duration[32];
+
+    // Queue alarm messages for the output thread
+    for (alarm = batch; alarm != NULL; alarm = alarm -> link) {
+        alarm_format_duration (alarm->duration, duration, sizeof (duration));
+        alarm_output_fd (alarm->client, "(%s) %s\n", duration,
+            alarm_message_text (alarm->message));
+        alarm_output_release (alarm->client);
+    }
+}
+
+/*
+ * The scheduler's delivery routine, with the sinks as "arg". The
+ * expired alarms are journaled as gone here, on the shard's expiry
+ * thread and before it applies any more requests, so the log has
+ * the shard's changes in the order it made them -- a start that
+ * reuses an expired alarm's id always follows the remove. (A
+ * periodic alarm's firings are copies and it is still pending, so
+ * the store only forgets alarms that have gone for good.) Only then
+ * are they delivered, to the sinks or, with -W, by the workers.
+ */
+void alarm_deliver (alarm_t *batch, void *arg)
+{
+    alarm_store_expired (batch);
+    if (alarm_workers != NULL) {
+        alarm_workers_deliver (batch, alarm_workers);
+    } else {
+        alarm_sink_deliver (batch, arg);
+    }
+}
+
+/*
+ * A fixed set of display threads report changes to groups, each
+ * group always on the same thread (chosen by group_id), so a
+ * group's reports come out in the order its alarms changed. A
+ * thread sleeps on its condition variable and is woken only when
+ * one of its groups' alarms changes, so idle groups cost nothing,
+ * and however many groups the clients make, the number of threads
+ * stays the same. Changes are handed over as a queue of events,
+ * each carrying a copy of the message, so the display threads never
+ * need to look at the timer queue or the message arena.
+ *
+ * Every display's event queue is protected by group_mutex. Nothing
+ * takes a scheduler lock while holding it.
+ */
+typedef struct group_event_tag {
+    struct group_event_tag *link;
     int                 group_id;
+    char                message[];      /* sized to fit */
+} group_event_t;
 
-} alarm_t;
+typedef struct group_display_tag {
+    pthread_t           thread;
+    pthread_cond_t      cond;           /* events queued */
+    group_event_t       *events;
+    group_event_t       **events_tail;
+} group_display_t;
 
-// Global synchronization objects
-pthread_mutex_t alarm_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t alarm_cond = PTHREAD_COND_INITIALIZER;
+#define GROUP_DISPLAYS  4
 
-// Shared alarm list and current alarm for condition signaling
-alarm_t *alarm_list = NULL;
-time_t current_alarm = 0;
+pthread_mutex_t group_mutex = PTHREAD_MUTEX_INITIALIZER;
+group_display_t group_displays[GROUP_DISPLAYS];
 
 /*
- * Insert alarm entry on list, in order.
+ * A display thread start routine. (Arthi S.)
  */
-void alarm_insert (alarm_t *alarm){
+void *alarm_group_display (void *arg)
+{
+    group_display_t *display = arg;
+    group_event_t *event, *events;
     int status;
-    alarm_t **last = &alarm_list, *next = *last;
+    STATS_TIMER(timer);
 
-    /*
-     * LOCKING PROTOCOL:
-     * 
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
-     */
+    status = pthread_mutex_lock(&group_mutex);
+    if (status != 0) {
+        err_abort(status, "Lock mutex");
+    }
+    while (1) {
+        while (display -> events == NULL) {
+            status = pthread_cond_wait(&display -> cond, &group_mutex);
+            if (status != 0) {
+                err_abort(status, "Wait on cond");
+            }
+        }
+        STATS_START(timer);
+
+        // Take the whole event queue and display it unlocked
+        events = display -> events;
+        display -> events = NULL;
+        display -> events_tail = &display -> events;
+        STATS_HOLD(ALARM_SITE_DISPLAY, timer);
+        status = pthread_mutex_unlock(&group_mutex);
+        if (status != 0) {
+            err_abort(status, "Unlock mutex");
+        }
 
-    // Traverse the list to find the correct insertion point
-    while (next != NULL && next -> time < alarm -> time) {
-        last = &next -> link;
-        next = next -> link;
+        while (events != NULL) {
+            event = events;
+            events = event -> link;
+            alarm_output("Group(%d) alarm ready: %s\n", event -> group_id, event -> message);
+            free(event);
+        }
+
+        STATS_START(timer);
+        status = pthread_mutex_lock(&group_mutex);
+        if (status != 0) {
+            err_abort(status, "Lock mutex");
+        }
+        STATS_WAIT(ALARM_SITE_DISPLAY, timer);
     }
-    alarm -> link = next;
-    *last = alarm;
+}
+
+/*
+ * Start the display threads, before anything can notify them.
+ */
+void alarm_group_display_creation(void)
+{
+    group_display_t *display;
+    int index, status;
 
-    // Signal the alarm thread if necessary
-    if (current_alarm == 0 || alarm -> time < current_alarm){
-        current_alarm = alarm -> time;
-        status = pthread_cond_signal(&alarm_cond);
+    for (index = 0; index < GROUP_DISPLAYS; index++) {
+        display = &group_displays[index];
+        display -> events = NULL;
+        display -> events_tail = &display -> events;
+        status = pthread_cond_init(&display -> cond, NULL);
+        if (status != 0) {
+            err_abort(status, "Init group cond");
+        }
+        status = pthread_create(&display -> thread, NULL, alarm_group_display, display);
+        if (status != 0) {
+            err_abort(status, "Create alarm group display thread");
+        }
+        status = pthread_detach(display -> thread);
+        if (status != 0) {
+            err_abort(status, "Detach alarm group display thread");
+        }
+    }
+}
+
+/*
+ * Tell a group's display thread that one of its alarms changed.
+ */
+void alarm_group_notify(int group_id, const char *message)
+{
+    group_display_t *display;
+    group_event_t *event;
+    int status, idle;
+    STATS_TIMER(timer);
+
+    event = (group_event_t*)malloc(sizeof(group_event_t) + strlen(message) + 1);
+    if (event == NULL) {
+        errno_abort("Allocate group event");
+    }
+    event -> link = NULL;
+    event -> group_id = group_id;
+    strcpy(event -> message, message);
+    display = &group_displays[((unsigned int) group_id * 2654435769u >> 8) % GROUP_DISPLAYS];
+
+    STATS_START(timer);
+    status = pthread_mutex_lock(&group_mutex);
+    if (status != 0) {
+        err_abort(status, "Lock mutex");
+    }
+    STATS_WAIT(ALARM_SITE_NOTIFY, timer);
+    idle = display -> events == NULL;
+    *display -> events_tail = event;
+    display -> events_tail = &event -> link;
+    if (idle) {
+        status = pthread_cond_signal(&display -> cond);
         if (status != 0) {
             err_abort(status, "Signal cond");
         }
     }
+    STATS_HOLD(ALARM_SITE_NOTIFY, timer);
+    status = pthread_mutex_unlock(&group_mutex);
+    if (status != 0) {
+        err_abort(status, "Unlock mutex");
+    }
 }
 
 /*
- * The alarm thread's start routine. (Arthi S.)
+ * A listing's snapshot, on its way to the thread that writes it out.
+ */
+typedef struct alarm_listing_tag {
+    alarm_t             *snapshot;      /* chained through link */
+    int                 count;
+    int                 group_id;
+    int                 request;        /* ALARM_LIST or ALARM_LIST_GROUP */
+    int                 client;
+} alarm_listing_t;
+
+/*
+ * Listings are written one at a time, so that two don't interleave.
+ */
+pthread_mutex_t alarm_listing_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Order listed alarms by deadline, then alarm_id.
  */
-void *alarm_thread (void *arg)
+static int alarm_listing_compare (const void *left, const void *right)
 {
-    alarm_t *alarm;
-    struct timespec cond_time;
-    time_t now;
-    int status, expired;
+    const alarm_t *a = *(alarm_t * const *) left, *b = *(alarm_t * const *) right;
 
-    /*
-     * Loop forever, processing commands. The alarm thread will
-     * be disintegrated when the process exits. Lock the mutex
-     * at the start -- it will be unlocked during condition
-     * waits, so the main thread can insert alarms.
-     */
-    status = pthread_mutex_lock (&alarm_mutex);
+    if (a -> time != b -> time) {
+        return a -> time < b -> time ? -1 : 1;
+    }
+    return (a -> alarm_id > b -> alarm_id) - (a -> alarm_id < b -> alarm_id);
+}
+
+/*
+ * Listing thread start routine: sort a snapshot and write it out
+ * for the client that asked, waiting for room in the output stage
+ * rather than dropping lines, then free it. None of this touches
+ * the scheduler, so however long the listing, the shards don't
+ * notice.
+ */
+void *alarm_listing_write (void *arg)
+{
+    alarm_listing_t *listing = arg;
+    alarm_t **sorted, *alarm;
+    alarm_time_t now = alarm_now (), left;
+    char duration[32], remaining[32];
+    int index, status;
+
+    sorted = (alarm_t**)malloc ((listing -> count + 1) * sizeof (alarm_t*));
+    if (sorted == NULL) {
+        errno_abort ("Allocate listing");
+    }
+    for (index = 0, alarm = listing -> snapshot; alarm != NULL; alarm = alarm -> link) {
+        sorted[index++] = alarm;
+    }
+    qsort (sorted, listing -> count, sizeof (alarm_t*), alarm_listing_compare);
+
+    status = pthread_mutex_lock (&alarm_listing_mutex);
     if (status != 0) {
         err_abort (status, "Lock mutex");
     }
+    if (listing -> request == ALARM_LIST_GROUP) {
+        alarm_output_wait (listing -> client, "Group(%d): %d alarm(s)\n",
+            listing -> group_id, listing -> count);
+    } else {
+        alarm_output_wait (listing -> client, "%d alarm(s)\n", listing -> count);
+    }
+    for (index = 0; index < listing -> count; index++) {
+        alarm = sorted[index];
+        left = alarm -> time > now ? alarm -> time - now : 0;
+        alarm_format_duration (alarm -> duration, duration, sizeof (duration));
+        alarm_format_duration (left, remaining, sizeof (remaining));
+        alarm_output_wait (listing -> client, "Alarm(%d): Group(%d) %s%s (%s left) %s\n",
+            alarm -> alarm_id, alarm -> group_id, alarm -> periodic ? "every " : "",
+            duration, remaining, alarm_message_text (alarm -> message));
+    }
+    status = pthread_mutex_unlock (&alarm_listing_mutex);
+    if (status != 0) {
+        err_abort (status, "Unlock mutex");
+    }
 
-    while (1) {
-        /*
-         * If the alarm list is empty, wait until an alarm is
-         * added. Setting current_alarm to 0 informs the insert
-         * routine that the thread is not busy.
-         */
-        // Reset the current alarm and wait for new alarms if the list is empty
-        current_alarm = 0;
-        while (alarm_list == NULL) {
-            status = pthread_cond_wait(&alarm_cond, &alarm_mutex);
-            if (status != 0) {
-                err_abort (status, "Wait on cond");
-            }
-        }
+    for (index = 0; index < listing -> count; index++) {
+        alarm_message_release (sorted[index] -> message);
+        alarm_free (sorted[index]);
+    }
+    alarm_output_release (listing -> client);
+    free (sorted);
+    free (listing);
+    return NULL;
+}
 
-        // Get the first alarm from the list
-        alarm = alarm_list;
-        alarm_list = alarm->link;
-
-        // Wait for the alarm's time
-        now = time (NULL);
-        expired = 0; // Initialize expired
-
-        if (alarm -> time > now) {
-            cond_time.tv_sec = alarm->time;
-            cond_time.tv_nsec = 0;
-            current_alarm = alarm->time;
-
-            while (current_alarm == alarm->time) {
-                status = pthread_cond_timedwait (&alarm_cond, &alarm_mutex, &cond_time);
-                
-                if (status == ETIMEDOUT) {
-                    expired = 1;
-                    break;
-                }
-                if (status != 0) {
-                    err_abort (status, "Cond timedwait");
-                }
-            }
+/*
+ * Hand a finished listing to a thread of its own to write out.
+ */
+void alarm_listing_start (alarm_t *request)
+{
+    alarm_listing_t *listing;
+    pthread_t thread;
+    int status;
 
-            // Reinsert the alarm if it was not expired
-            if (!expired) {
-                alarm_insert (alarm);
-            }
+    listing = (alarm_listing_t*)malloc (sizeof (alarm_listing_t));
+    if (listing == NULL) {
+        errno_abort ("Allocate listing");
+    }
+    listing -> snapshot = request -> link;
+    listing -> count = request -> alarm_id;
+    listing -> group_id = request -> group_id;
+    listing -> request = request -> request;
+    listing -> client = request -> client;
+    status = pthread_create (&thread, NULL, alarm_listing_write, listing);
+    if (status != 0) {
+        err_abort (status, "Create listing thread");
+    }
+    status = pthread_detach (thread);
+    if (status != 0) {
+        err_abort (status, "Detach listing thread");
+    }
+}
+
+/*
+ * Report routine for the scheduler: confirm or reject each request
+ * to the client that made it. Runs on a shard's expiry thread with
+ * the shard locked, which is why everything goes through the output
+ * stage, and confirmations of changes through the store, which holds
+ * them until the changes are durable. Except for a started alarm, which keeps it until it
+ * expires or is removed, the request's hold on its client ends here;
+ * each firing of a periodic alarm takes a hold of its own, and a
+ * listing's hold passes to the thread that writes it out.
+ */
+void alarm_reported (alarm_t *alarm, int result, void *arg)
+{
+    switch (result) {
+    case ALARM_STARTED:
+        if (alarm -> request != ALARM_RESTORE) {
+            alarm_store_started (alarm);
+        }
+        alarm_group_notify (alarm -> group_id, alarm_message_text (alarm -> message));
+        return;
+    case ALARM_REARMED:
+        // Released when the firing is printed, as an expiry is
+        alarm_output_hold (alarm -> client);
+        return;
+    case ALARM_LISTED:
+        alarm_listing_start (alarm);
+        return;
+    case ALARM_EXISTS:
+        alarm_output_fd (alarm_error_fd (alarm -> client),
+            "Alarm(%d) already exists\n", alarm -> alarm_id);
+        break;
+    case ALARM_CHANGED:
+        alarm_store_changed (alarm);
+        alarm_store_reply (alarm -> client, "Alarm(%d) updated successfully\n", alarm -> alarm_id);
+        alarm_group_notify (alarm -> group_id, alarm_message_text (alarm -> message));
+        break;
+    case ALARM_NOT_FOUND:
+        alarm_output_fd (alarm_error_fd (alarm -> client),
+            "Alarm(%d) not found\n", alarm -> alarm_id);
+        break;
+    case ALARM_REMOVED:
+        // The hold taken when the alarm was started ends here
+        alarm_store_removed (alarm);
+        break;
+    case ALARM_CANCELLED:
+        if (alarm -> request == ALARM_CANCEL_GROUP) {
+            alarm_store_reply (alarm -> client, "Group(%d) cancelled: %d alarm(s)\n",
+                alarm -> group_id, alarm -> alarm_id);
         } else {
-            expired = 1;    // Alarm already expired
+            alarm_store_reply (alarm -> client, "Alarm(%d) cancelled\n", alarm -> alarm_id);
         }
+        break;
+    }
+    alarm_output_release (alarm -> client);
+}
+
+/*
+ * Build the alarm for a parsed Start_Alarm or Start_Periodic_Alarm,
+ * holding its client. A periodic alarm first fires one period on.
+ * Its message is 0 if the arena had no room for the text.
+ */
+alarm_t *alarm_create (alarm_command_t *command, int client)
+{
+    alarm_t *alarm = alarm_alloc ();
+
+    alarm -> alarm_id = command -> alarm_id;
+    alarm -> group_id = command -> group_id;
+    alarm -> duration = command -> duration;
+    alarm -> time = alarm_now () + command -> duration;
+    alarm -> message = alarm_message_store (command -> message, command -> message_length);
+    alarm -> client = client;
+    alarm -> periodic = command -> type == ALARM_COMMAND_PERIODIC;
+    alarm_output_hold (client);
+    return alarm;
+}
 
-        // Print alarm message
-        if (expired) {
-            printf ("(%d) %s\n", alarm->seconds, alarm->message);
-            free (alarm);
+/*
+ * Write one line of the scheduler's stats report to a client.
+ */
+static void alarm_stats_line (const char *line, void *arg)
+{
+    alarm_output_fd (*(int*)arg, "%s\n", line);
+}
+
+/*
+ * Answer a Stats command, or dump the stats for -d.
+ */
+void alarm_show_stats (int client)
+{
+    alarm_store_stats_t journal;
+    unsigned long records, dropped;
+    alarm_usage_t usage;
+
+    alarm_store_stats (&journal);
+    if (journal.commits == 0) {
+        alarm_output_fd (client, "Journal: no commits\n");
+    } else {
+        alarm_output_fd (client, "Journal: %lu commits, %lu changes (%.1f per commit, max %lu), "
+            "%lu bytes, sync %.3f ms average, %.3f ms max, %lu compactions\n",
+            journal.commits, journal.entries, (double) journal.entries / journal.commits,
+            journal.max_batch, journal.bytes,
+            (double) journal.sync_total / journal.commits / ALARM_NSEC_PER_MSEC,
+            (double) journal.sync_max / ALARM_NSEC_PER_MSEC, journal.compactions);
+    }
+    if (alarm_records != NULL) {
+        alarm_sink_counts (alarm_records, &records, &dropped);
+        alarm_output_fd (client, "Records: %lu written, %lu dropped\n", records, dropped);
+    }
+    if (alarm_workers != NULL) {
+        alarm_workers_counts (alarm_workers, &records, &dropped);
+        alarm_output_fd (client, "Workers: %lu alarms run, %lu stolen\n", records, dropped);
+    }
+    alarm_sched_usage (alarm_scheduler, &usage);
+    alarm_output_fd (client, "Admission: %ld alarms pending (peak %ld), %lu bytes (peak %lu), "
+        "%lu waits, %lu rejected\n", usage.alarms, usage.peak_alarms, usage.bytes,
+        usage.peak_bytes, usage.waits, atomic_load (&alarm_rejected));
+    alarm_stats_report (alarm_stats_line, &client);
+}
+
+/*
+ * Stats dump thread start routine: show the stats to stdout every
+ * alarm_dump_interval.
+ */
+void *alarm_stats_dump (void *arg)
+{
+    alarm_time_t interval = alarm_dump_interval;
+    struct timespec delay;
+
+    delay.tv_sec = interval / ALARM_NSEC_PER_SEC;
+    delay.tv_nsec = interval % ALARM_NSEC_PER_SEC;
+    while (1) {
+        while (nanosleep (&delay, &delay) != 0) {
+            // Interrupted: sleep out the rest of the interval
         }
+        delay.tv_sec = interval / ALARM_NSEC_PER_SEC;
+        delay.tv_nsec = interval % ALARM_NSEC_PER_SEC;
+        alarm_show_stats (STDOUT_FILENO);
     }
 }
 
-// Arthi S.
-void *alarm_group_display_creation(void *arg) {
+/*
+ * Refuse a new alarm that the limits, given as the ALARM_LIMIT_ that
+ * refused it, leave no room for, and free it.
+ */
+void alarm_reject (alarm_t *alarm, int limit)
+{
+    atomic_fetch_add (&alarm_rejected, 1);
+    alarm_output_fd (alarm_error_fd (alarm -> client), "Alarm(%d) rejected: %s\n",
+        alarm -> alarm_id, limit == ALARM_LIMIT_ALARMS ? "too many alarms"
+        : limit == ALARM_LIMIT_GROUP ? "too many alarms in group"
+        : limit == ALARM_LIMIT_MESSAGES ? "out of message space"
+        : "out of memory");
+    alarm_message_release (alarm -> message);
+    alarm_output_release (alarm -> client);
+    alarm_free (alarm);
+}
+
+/*
+ * Run one command line of "length" bytes from "client": the terminal
+ * (STDOUT_FILENO) or a network connection. Called from the main
+ * thread and from the network event thread, so it only hands
+ * requests to the scheduler and writes through the output stage.
+ * The message goes from the line into the arena without a copy.
+ */
+void alarm_command (const char *line, size_t length, int client)
+{
+    alarm_command_t command;
+    alarm_message_t message;
+    alarm_t *alarm;
+    int error = alarm_error_fd (client);
     int status;
 
-    while(1) {
-        status = pthread_mutex_lock(&alarm_mutex);
+    if (length >= ALARM_LINE) {
+        alarm_output_fd (error, "Command too long\n");
+        return;
+    }
+
+    // Parse the input as a command
+    status = alarm_parse (line, length, &command);
+    switch (command.type) {
+    case ALARM_COMMAND_NONE:
+        break;
+    case ALARM_COMMAND_START:
+    case ALARM_COMMAND_PERIODIC:
         if (status != 0) {
-            err_abort(status, "Lock mutex");  
+            alarm_output_fd (error, command.type == ALARM_COMMAND_START
+                ? "Bad Start_Alarm command format\n"
+                : "Bad Start_Periodic_Alarm command format\n");
+            break;
         }
 
-        // Traverse list and create display threads for the new groups
-        alarm_t *current = alarm_list;
-        while (current != NULL) {
-            // Display message
-            printf("Group(%d) alarm ready: %s\n", current -> group_id, current -> message);
-            current = current -> link;
+        /*
+         * Hand a new alarm to its shard; the outcome is reported.
+         * If the limits leave no room, the terminal waits a while
+         * for some, holding up only itself, but the network event
+         * thread serves every client, so a network client is
+         * refused at once.
+         */
+        alarm = alarm_create (&command, client);
+        status = alarm -> message == 0 ? ALARM_LIMIT_MESSAGES
+            : alarm_admit (alarm_scheduler, alarm,
+                client == STDOUT_FILENO ? ALARM_ADMIT_WAIT : ALARM_ADMIT_TRY);
+        if (status != 0) {
+            alarm_reject (alarm, status);
+            break;
+        }
+        alarm_submit (alarm_scheduler, alarm);
+        break;
+    case ALARM_COMMAND_CHANGE:
+        if (status != 0) {
+            alarm_output_fd (error, "Invalid Change_Alarm command format\n");
+            break;
         }
 
-        status = pthread_mutex_unlock(&alarm_mutex);
+        // Modify an existing alarm; the outcome is reported
+        message = alarm_message_store (command.message, command.message_length);
+        if (message == 0) {
+            atomic_fetch_add (&alarm_rejected, 1);
+            alarm_output_fd (error, "Change_Alarm(%d) rejected: out of message space\n",
+                command.alarm_id);
+            break;
+        }
+        alarm_output_hold (client);
+        alarm_change (alarm_scheduler, command.alarm_id, command.group_id,
+            command.duration, message, client);
+        break;
+    case ALARM_COMMAND_CANCEL:
         if (status != 0) {
-            err_abort(status, "Unlock mutex");
+            alarm_output_fd (error, "Bad Cancel_Alarm command format\n");
+            break;
+        }
+        alarm_output_hold (client);
+        alarm_cancel (alarm_scheduler, command.alarm_id, client);
+        break;
+    case ALARM_COMMAND_CANCEL_GROUP:
+        if (status != 0) {
+            alarm_output_fd (error, "Bad Cancel_Group command format\n");
+            break;
+        }
+        alarm_output_hold (client);
+        alarm_cancel_group (alarm_scheduler, command.group_id, client);
+        break;
+    case ALARM_COMMAND_LIST:
+        if (status != 0) {
+            alarm_output_fd (error, "Bad List_Alarms command format\n");
+            break;
+        }
+
+        // Each shard copies its alarms; a listing thread writes them
+        alarm_output_hold (client);
+        alarm_list (alarm_scheduler, client);
+        break;
+    case ALARM_COMMAND_LIST_GROUP:
+        if (status != 0) {
+            alarm_output_fd (error, "Bad List_Group command format\n");
+            break;
+        }
+        alarm_output_hold (client);
+        alarm_list_group (alarm_scheduler, command.group_id, client);
+        break;
+    case ALARM_COMMAND_STATS:
+        if (status != 0) {
+            alarm_output_fd (error, "Bad Stats command format\n");
+            break;
         }
+        alarm_show_stats (client);
+        break;
+    default:
+        alarm_output_fd (error, "Unknown command: %.*s\n",
+            (int) command.name_length, command.name);
+        break;
+    }
+}
+
+/*
+ * Most start commands alarm_load gathers before submitting.
+ */
+#define ALARM_LOAD_BATCH        8192
+
+/*
+ * Load a schedule from a file (or pipe) of commands. Runs of
+ * Start_Alarm commands are parsed into chains of alarms and handed
+ * (periodic or not) to the scheduler with alarm_submit_batch, so each shard is
+ * touched once per batch instead of once per alarm; any other
+ * command first submits the batch so far, keeping the file's order,
+ * and then runs as if typed. Returns the number of alarms submitted,
+ * or -1 if the file can't be opened.
+ */
+long alarm_load (const char *path)
+{
+    char line[ALARM_LINE];
+    alarm_command_t command;
+    alarm_t *batch = NULL, **last = &batch, *alarm;
+    long loaded = 0;
+    int count = 0, started, status;
+    size_t length;
+    FILE *file;
+
+    file = fopen (path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    while (fgets (line, sizeof (line), file) != NULL) {
+        length = strlen (line);
+        started = alarm_parse (line, length, &command) == 0
+            && (command.type == ALARM_COMMAND_START
+                || command.type == ALARM_COMMAND_PERIODIC);
+        if (started) {
+            alarm = alarm_create (&command, STDOUT_FILENO);
+            if (alarm -> message == 0) {
+                alarm_reject (alarm, ALARM_LIMIT_MESSAGES);
+                continue;
+            }
+
+            // No room: let the batch in, then wait as the terminal does
+            if (alarm_admit (alarm_scheduler, alarm, ALARM_ADMIT_TRY) != 0) {
+                *last = NULL;
+                alarm_submit_batch (alarm_scheduler, batch, ALARM_START);
+                batch = NULL;
+                last = &batch;
+                count = 0;
+                status = alarm_admit (alarm_scheduler, alarm, ALARM_ADMIT_WAIT);
+                if (status != 0) {
+                    alarm_reject (alarm, status);
+                    continue;
+                }
+            }
+            *last = alarm;
+            last = &alarm -> link;
+            loaded++;
+            if (++count < ALARM_LOAD_BATCH) {
+                continue;
+            }
+        } else if (command.type == ALARM_COMMAND_NONE) {
+            continue;
+        }
+
+        // Submit what we have, then run any other command in order
+        *last = NULL;
+        alarm_submit_batch (alarm_scheduler, batch, ALARM_START);
+        batch = NULL;
+        last = &batch;
+        count = 0;
+        if (!started) {
+            alarm_command (line, length, STDOUT_FILENO);
+        }
+    }
+    *last = NULL;
+    alarm_submit_batch (alarm_scheduler, batch, ALARM_START);
+    fclose (file);
+    return loaded;
+}
+
+/*
+ * Parse a size for -M: a number of bytes, optionally followed by
+ * "k", "M" or "G". Returns -1 if it isn't one.
+ */
+int alarm_parse_size (const char *text, unsigned long *size)
+{
+    char *end;
+
+    *size = strtoul (text, &end, 10);
+    if (end == text) {
+        return -1;
+    }
+    switch (*end) {
+    case 'k':
+        *size <<= 10;
+        end++;
+        break;
+    case 'M':
+        *size <<= 20;
+        end++;
+        break;
+    case 'G':
+        *size <<= 30;
+        end++;
+        break;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * Most -a options main accepts.
+ */
+#define ALARM_WAITS     64
 
-        sleep(1);   // Preiodically recheck the alarm list
+/*
+ * Apply a -a option, "strategy[:spin][@shard]", to the scheduler:
+ * to one shard if it names one, otherwise to all of them. Returns
+ * -1 if the option is malformed or alarm_sched_wait rejects it.
+ */
+int alarm_wait_option (const char *option)
+{
+    char strategy[16];
+    const char *end = option + strcspn (option, ":@"), *at = strchr (option, '@');
+    alarm_time_t spin = 0;
+    int shard = -1;
+
+    if (end - option >= (long) sizeof (strategy)) {
+        return -1;
+    }
+    memcpy (strategy, option, end - option);
+    strategy[end - option] = '\0';
+    if (*end == ':') {
+        end++;
+        if (alarm_parse_duration (end, (at != NULL ? at : end + strlen (end)) - end, &spin) != 0) {
+            return -1;
+        }
+    }
+    if (at != NULL) {
+        shard = atoi (at + 1);
     }
+    return alarm_sched_wait (alarm_scheduler, shard, strategy, spin);
 }
 
 int main (int argc, char *argv[])
 {
-    int status;
-    char line[128]; // Input buffer for user commands
-    alarm_t *alarm;
-    pthread_t alarm_handler_thread, display_creation_thread;
+    char line[ALARM_LINE]; // Input buffer for user commands
+    const char *backend = ALARM_QUEUE_DEFAULT, *load = NULL, *store = NULL, *records = NULL;
+    const char *waits[ALARM_WAITS];
+    long shards = sysconf (_SC_NPROCESSORS_ONLN), loaded;
+    alarm_time_t window = 10 * ALARM_NSEC_PER_MSEC, slack = 0;
+    pthread_t thread;
+    alarm_sink_t *sinks;
+    int option, listening = 0, status, fd, workers = 0, ordered = 0, wait_count = 0;
+    long max_alarms = 0;
+    int max_group = 0;
+    unsigned long max_bytes = 0;
 
-    // Create the alarm handler thread
-    status = pthread_create (&alarm_handler_thread, NULL, alarm_thread, NULL);
-    if (status != 0) {
-        err_abort (status, "Create alarm thread");
+    /*
+     * Select the timer queue backend ("-q list|heap|wheel") and the
+     * number of scheduler shards ("-s N", one per CPU by default),
+     * say where to accept network clients ("-l address", as often
+     * as needed), name a schedule to load at startup ("-f file"),
+     * keep pending alarms in a store across restarts ("-p path"),
+     * set the store's group commit window ("-w duration"), and let
+     * alarms fire late by up to a timer slack to share wake-ups
+     * ("-t duration"), show the stats periodically ("-d
+     * duration"), also write expired alarms as binary records to a
+     * file or FIFO ("-e path"), and deliver expired alarms on a pool
+     * of worker threads ("-W threads"), keeping each group's in
+     * order ("-G"), and choose how shards wait for their deadlines
+     * ("-a strategy[:spin][@shard]", as often as needed), and limit
+     * the alarms pending in all ("-n alarms"), in any one group ("-g
+     * alarms") and the memory they take up ("-M bytes").
+     */
+    while ((option = getopt (argc, argv, "q:s:l:f:p:w:t:d:e:W:Ga:n:g:M:")) != -1) {
+        switch (option) {
+        case 'q':
+            backend = optarg;
+            break;
+        case 's':
+            shards = atol (optarg);
+            break;
+        case 'l':
+            if (alarm_net_listen (optarg) != 0) {
+                fprintf (stderr, "Listen on %s: %s\n", optarg, strerror (errno));
+                exit (1);
+            }
+            listening = 1;
+            break;
+        case 'f':
+            load = optarg;
+            break;
+        case 'p':
+            store = optarg;
+            break;
+        case 'w':
+            if (alarm_parse_duration (optarg, strlen (optarg), &window) != 0) {
+                fprintf (stderr, "Bad commit window: %s\n", optarg);
+                exit (1);
+            }
+            break;
+        case 't':
+            if (alarm_parse_duration (optarg, strlen (optarg), &slack) != 0) {
+                fprintf (stderr, "Bad timer slack: %s\n", optarg);
+                exit (1);
+            }
+            break;
+        case 'e':
+            records = optarg;
+            break;
+        case 'W':
+            workers = atoi (optarg);
+            break;
+        case 'G':
+            ordered = 1;
+            break;
+        case 'a':
+            if (wait_count < ALARM_WAITS) {
+                waits[wait_count++] = optarg;
+            }
+            break;
+        case 'n':
+            max_alarms = atol (optarg);
+            break;
+        case 'g':
+            max_group = atoi (optarg);
+            break;
+        case 'M':
+            if (alarm_parse_size (optarg, &max_bytes) != 0) {
+                fprintf (stderr, "Bad memory limit: %s\n", optarg);
+                exit (1);
+            }
+            break;
+        case 'd':
+            if (alarm_parse_duration (optarg, strlen (optarg), &alarm_dump_interval) != 0
+                || alarm_dump_interval <= 0) {
+                fprintf (stderr, "Bad stats interval: %s\n", optarg);
+                exit (1);
+            }
+            break;
+        default:
+            fprintf (stderr, "usage: %s [-q list|heap|wheel] [-s shards] [-l address]... [-f file]\n"
+                "       [-p path [-w window]] [-t slack] [-d interval] [-e path]\n"
+                "       [-W threads [-G]] [-a cond|timerfd[:spin][@shard]]...\n"
+                "       [-n alarms] [-g alarms] [-M bytes]\n", argv[0]);
+            exit (1);
+        }
+    }
+    if (shards < 1) {
+        shards = 1;
     }
 
-    // Create the alarm group display creation thread
-    status = pthread_create(&display_creation_thread, NULL, alarm_group_display_creation, NULL);
-    if (status != 0) {
-        err_abort(status, "Create alarm group display thread");
+    /*
+     * Notifications produced by the scheduler and the display
+     * threads go through the asynchronous output stage, so a slow
+     * stdout never holds up the scheduler.
+     */
+    alarm_output_start (STDOUT_FILENO);
+    alarm_group_display_creation ();
+
+    /*
+     * Expired alarms are printed for their clients and, with -e,
+     * written to "records" too. The records descriptor is made
+     * non-blocking once open, so a reader that falls behind loses
+     * records rather than stalling a shard.
+     */
+    sinks = alarm_sink_callback (alarm_expired, NULL);
+    if (records != NULL) {
+        fd = open (records, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0 || fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK) < 0) {
+            fprintf (stderr, "Open %s: %s\n", records, strerror (errno));
+            exit (1);
+        }
+        alarm_records = alarm_sink_records (fd);
+        alarm_sink_add (sinks, alarm_records);
     }
 
-    // Main loop to handle user commands
-    while (1) {
-        printf ("Alarm> ");
-        if (fgets (line, sizeof(line), stdin) == NULL) exit (0);    // Exit on EOF
-        if (strlen (line) <= 1) continue;   // Ignore empty input
+    /*
+     * Start the scheduler shards and their expiry threads, which
+     * deliver to the sinks themselves or, with -W, hand expired
+     * alarms to the worker pool to deliver.
+     */
+    if (workers > 0) {
+        alarm_workers = alarm_workers_create (workers, ordered, alarm_sink_deliver, sinks);
+    }
+    alarm_scheduler = alarm_sched_create ((int) shards, backend, slack,
+        alarm_deliver, alarm_reported, sinks);
+    if (alarm_scheduler == NULL) {
+        fprintf (stderr, "Unknown timer queue backend: %s\n", backend);
+        exit (1);
+    }
+    alarm_sched_limit (alarm_scheduler, max_alarms, max_group, max_bytes);
+    for (option = 0; option < wait_count; option++) {
+        if (alarm_wait_option (waits[option]) != 0) {
+            fprintf (stderr, "Bad wait strategy: %s\n", waits[option]);
+            exit (1);
+        }
+    }
+    alarm_sched_start (alarm_scheduler);
 
-        char command[16];
-        int alarm_id, group_id, seconds;
-        char message[128];
-        
-        // Parse the input as a command
-        if (sscanf(line, "%15s", command) == 1) {
-            if (strcmp(command, "Start_Alarm") == 0) {
-                // Parse Start_Alarm command
-                if (sscanf(line, "%*s(%d): Group(%d) %d %[^\n]", &alarm_id, &group_id, &seconds, message) != 4){
-                    fprintf(stderr, "Bad Start_Alarm command format\n");
-                    continue;
-                }
-                
-                // Create and initialize a new alarm
-                alarm = (alarm_t*)malloc (sizeof (alarm_t));
-                if (alarm == NULL) {
-                    errno_abort ("Allocate alarm");
-                }
-                alarm -> alarm_id = alarm_id;
-                alarm -> group_id = group_id;
-                alarm -> seconds = seconds;
-                alarm -> time = time(NULL) + seconds;
-                strncpy(alarm -> message, message, sizeof(alarm -> message) - 1);
-                alarm -> message[sizeof(alarm -> message) - 1] = '\0';
-
-                // Insert the alarm into the list
-                status = pthread_mutex_lock(&alarm_mutex);
-                if (status != 0) {
-                    err_abort(status, "Lock mutex");
-                }
-                alarm_insert(alarm);
-                status = pthread_mutex_unlock(&alarm_mutex);
-                if (status != 0) {
-                    err_abort(status, "Unlock mutex");
-                }
-            } else if (strcmp(command, "Change_Alarm") == 0) {
-                // Parse Change_Alarm command
-                if (sscanf(line, "%*s(%d): Group(%d) %[^\n]", &alarm_id, &group_id, &seconds, message) != 4) {
-                    fprintf(stderr, "Invalid Change_Alarm command format\n");
-                    continue;
-                }
+    // Bring back the alarms pending when we last stopped
+    if (store != NULL) {
+        loaded = alarm_store_open (alarm_scheduler, store, STDOUT_FILENO, window);
+        if (loaded < 0) {
+            fprintf (stderr, "Open store %s: %s\n", store, strerror (errno));
+            exit (1);
+        }
+        alarm_output ("Restored %ld alarms from %s\n", loaded, store);
+    }
 
-                // Modify an existing alarm
-                status = pthread_mutex_lock(&alarm_mutex);
-                if (status != 0) {
-                    err_abort(status, "Lock mutex");
-                }
-                alarm_t *current = alarm_list;
-
-                while (current != NULL) {
-                    if (current->alarm_id == alarm_id) { // Match using alarm_id
-                        current->group_id = group_id;
-                        current->seconds = seconds;
-                        current->time = time(NULL) + seconds;
-                        strncpy(current->message, message, sizeof(current->message) - 1);
-                        current->message[sizeof(current->message) - 1] = '\0';
-                        printf("Alarm(%d) updated successfully\n", alarm_id);
-                        break;
-                    }
-                    current = current->link;
-                }
-                if (current == NULL) {
-                    fprintf(stderr, "Alarm(%d) not found\n", alarm_id);
-                }
-                status = pthread_mutex_unlock(&alarm_mutex);
+    // Bulk-load the schedule, if any
+    if (load != NULL) {
+        loaded = alarm_load (load);
+        if (loaded < 0) {
+            fprintf (stderr, "Load %s: %s\n", load, strerror (errno));
+            exit (1);
+        }
+        alarm_output ("Loaded %ld alarms from %s\n", loaded, load);
+    }
 
-                if (status != 0) {
-                    err_abort(status, "Unlock mutex");
-                }
-            } else {
-                fprintf(stderr, "Unknown command: %s\n", command);
+    // Dump the stats every interval, if asked
+    if (alarm_dump_interval > 0) {
+        status = pthread_create (&thread, NULL, alarm_stats_dump, NULL);
+        if (status != 0) {
+            err_abort (status, "Create stats thread");
+        }
+        status = pthread_detach (thread);
+        if (status != 0) {
+            err_abort (status, "Detach stats thread");
+        }
+    }
+
+    // Network clients are served alongside the terminal
+    if (listening) {
+        alarm_net_start (alarm_command);
+    }
+
+    // Main loop to handle user commands
+    while (1) {
+        printf ("Alarm> ");
+        if (fgets (line, sizeof(line), stdin) == NULL) {
+            // Exit on EOF, unless there are network clients to serve
+            if (listening) {
+                pthread_exit (NULL);
             }
+            exit (0);
         }
+        if (strlen (line) <= 1) continue;   // Ignore empty input
+        alarm_command (line, strlen (line), STDOUT_FILENO);
     }
     return 0;
 }